@@ -0,0 +1,87 @@
+/*
+ * client.c - reply readers and request encoding shared by the clients
+ */
+#include "client.h"
+
+/* Copy one reply to stdout; mode is STREAM_FIXED or STREAM_LENGTH */
+void read_reply(rio_t *rp, char *buf, int mode)
+{
+    uint32_t hdr, len;
+
+    if (mode == STREAM_FIXED) {
+	/* a reply ends with the first frame that holds a NUL */
+	do {
+	    if (Rio_readnb(rp, buf, MAXLINE) != MAXLINE)
+		app_error("connection closed mid reply");
+	    fwrite(buf, 1, strnlen(buf, MAXLINE), stdout);
+	} while (memchr(buf, '\0', MAXLINE) == NULL);
+	return;
+    }
+    do {
+	if (Rio_readnb(rp, &hdr, STREAM_HDR) != STREAM_HDR)
+	    app_error("connection closed mid reply");
+	hdr = ntohl(hdr);
+	len = hdr & ~STREAM_MORE;
+	if (len > MAXLINE || Rio_readnb(rp, buf, len) != len)
+	    app_error("bad reply chunk");
+	fwrite(buf, 1, len, stdout);
+    } while (hdr & STREAM_MORE);
+}
+
+/* Turn a text command into a binary request; unknown commands get op 0 */
+void encode_request(char *line, bin_req *req)
+{
+    char cmd[8];
+    int id = 0, num = 0;
+
+    req->op = 0;
+    if (sscanf(line, "%7s %d %d", cmd, &id, &num) >= 1) {
+	if (!strcmp(cmd, "show"))
+	    req->op = BIN_SHOW;
+	else if (!strcmp(cmd, "buy"))
+	    req->op = BIN_BUY;
+	else if (!strcmp(cmd, "sell"))
+	    req->op = BIN_SELL;
+	else if (!strcmp(cmd, "exit"))
+	    req->op = BIN_EXIT;
+    }
+    req->op = htonl(req->op);
+    req->id = htonl(id);
+    req->quantity = htonl(num);
+}
+
+/* Copy one binary reply to stdout, worded like the text replies */
+void read_binary_reply(rio_t *rp, int op)
+{
+    bin_reply r;
+    int stocks = 0;
+
+    for (;;) {
+	if (Rio_readnb(rp, &r, sizeof(r)) != sizeof(r))
+	    app_error("connection closed mid reply");
+	if (ntohl(r.status) != BIN_STOCK)
+	    break;
+	printf("%d %d %d\n", (int)ntohl(r.id), (int)ntohl(r.quantity), (int)ntohl(r.price));
+	stocks++;
+    }
+    if (ntohl(r.status) == BIN_SHORT)
+	printf("Not enough left stock\n");
+    else if (ntohl(r.status) != BIN_OK)
+	printf("Wrong Command!\n");
+    else if (op == BIN_SHOW && stocks == 0)
+	printf("No stocks available\n");
+    else if (op == BIN_BUY)
+	printf("[buy] success\n");
+    else if (op == BIN_SELL)
+	printf("[sell] success\n");
+}
+
+/* Switch the connection to the binary protocol */
+void start_binary(int clientfd, rio_t *rp)
+{
+    bin_reply r;
+
+    Rio_writen(clientfd, BIN_HELLO, strlen(BIN_HELLO));
+    if (Rio_readnb(rp, &r, sizeof(r)) != sizeof(r) || ntohl(r.status) != BIN_OK)
+	app_error("server refused the binary protocol");
+}
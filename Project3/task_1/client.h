@@ -0,0 +1,16 @@
+/*
+ * client.h - reply readers and request encoding shared by the clients
+ */
+#ifndef __CLIENT_H__
+#define __CLIENT_H__
+
+#include "csapp.h"
+#include "stream.h"
+#include "proto.h"
+
+void read_reply(rio_t *rp, char *buf, int mode);
+void encode_request(char *line, bin_req *req);
+void read_binary_reply(rio_t *rp, int op);
+void start_binary(int clientfd, rio_t *rp);
+
+#endif /* __CLIENT_H__ */
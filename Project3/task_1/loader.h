@@ -0,0 +1,11 @@
+/*
+ * loader.h - parallel parser for the text stock catalog
+ */
+#ifndef __LOADER_H__
+#define __LOADER_H__
+
+#include "stockdb.h"
+
+int load_catalog(const char *filename, StockRec **recsp, long *linesp);
+
+#endif /* __LOADER_H__ */
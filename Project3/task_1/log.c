@@ -0,0 +1,176 @@
+/*
+ * log.c - asynchronous logger: per-thread rings drained by one thread
+ *
+ * Each thread that logs gets its own single-producer ring, so writing a
+ * record takes no lock and touches no shared cache line: the thread reads
+ * the clock, copies the format pointer and arguments into the next slot
+ * and publishes it with a release store. A background thread walks the
+ * rings, formats the records and writes them to stdout in large chunks.
+ * When a ring is full the record is dropped and counted rather than
+ * making the request path wait for the drain thread. With nothing to
+ * drain the thread sleeps on log_wake, and the first record written
+ * after it went idle wakes it; the timeout is only a backstop.
+ */
+#include "csapp.h"
+#include "log.h"
+
+#define LOG_BACKSTOP 1     /* Seconds the idle drain thread sleeps unless woken */
+
+typedef struct {
+    long sec, nsec;
+    const char *fmt;
+    int level;
+    long arg[LOG_MAXARGS];
+} log_rec;
+
+typedef struct log_ring {
+    struct log_ring *next;
+    unsigned head;                  /* Next record to drain; written by the drain side */
+    char pad[64];
+    unsigned tail;                  /* Next free slot; written by the owner */
+    long calls;                     /* LOG_SAMPLED calls, for sampling */
+    long dropped;
+    log_rec recs[LOG_RING];
+} log_ring;
+
+int log_level = LOG_INFO;
+long log_sample = 1;
+log_ring *log_rings = NULL;          /* Every thread's ring, pushed at first use */
+__thread log_ring *log_mine = NULL;
+sem_t log_mutex;                     /* One drainer at a time: the thread or log_flush */
+long log_reported = 0;               /* Drops already reported */
+sem_t log_wake;                      /* Posted when a record arrives for an idle drain thread */
+int log_idle = 0;                    /* Set while the drain thread waits on log_wake */
+
+static const char *log_names[] = { "debug", "info", "warn", "error", "off" };
+
+/* Level for name, or -1 */
+int log_parse_level(const char *name) {
+    for (int i = LOG_DEBUG; i <= LOG_OFF; i++) {
+        if (!strcmp(name, log_names[i])) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static log_ring *log_attach(void) {
+    log_ring *r = Calloc(1, sizeof(log_ring));
+
+    r->next = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE);
+    while (!__atomic_compare_exchange_n(&log_rings, &r->next, r, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+        ;
+    return log_mine = r;
+}
+
+void log_write(int level, int sampled, const char *fmt, ...) {
+    log_ring *r = log_mine ? log_mine : log_attach();
+    struct timespec ts;
+    log_rec *rec;
+    const char *p;
+    va_list ap;
+    int n = 0;
+
+    if (sampled && r->calls++ % log_sample != 0) {
+        return;
+    }
+    if (r->tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == LOG_RING) {
+        __atomic_add_fetch(&r->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    rec = &r->recs[r->tail & (LOG_RING - 1)];
+    clock_gettime(CLOCK_REALTIME, &ts);
+    rec->sec = ts.tv_sec;
+    rec->nsec = ts.tv_nsec;
+    rec->fmt = fmt;
+    rec->level = level;
+    va_start(ap, fmt);
+    for (p = fmt; (p = strchr(p, '%')) != NULL && n < LOG_MAXARGS; p += 2) {
+        if (p[1] != '%') {
+            rec->arg[n++] = va_arg(ap, long);
+        }
+    }
+    va_end(ap);
+    __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+    /* Pairs with the fence in log_thread: either it sees this record or we see it idle */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&log_idle, __ATOMIC_RELAXED)
+        && __atomic_exchange_n(&log_idle, 0, __ATOMIC_RELAXED)) {
+        V(&log_wake);
+    }
+}
+
+static void log_format(log_rec *rec) {
+    time_t sec = rec->sec;
+    struct tm tm;
+    char stamp[32];
+
+    localtime_r(&sec, &tm);
+    strftime(stamp, sizeof(stamp), "%H:%M:%S", &tm);
+    printf("%s.%06ld %s ", stamp, rec->nsec / 1000, log_names[rec->level]);
+    printf(rec->fmt, rec->arg[0], rec->arg[1], rec->arg[2], rec->arg[3], rec->arg[4], rec->arg[5]);
+    putchar('\n');
+}
+
+/* Write out everything published so far; returns how many records that was */
+static long log_drain(void) {
+    log_ring *r;
+    unsigned tail;
+    long n = 0, dropped = 0;
+
+    P(&log_mutex);
+    flockfile(stdout);
+    for (r = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+        tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        for (; r->head != tail; n++) {
+            log_format(&r->recs[r->head & (LOG_RING - 1)]);
+            __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+        }
+        dropped += __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+    }
+    if (dropped > log_reported) {
+        printf("log: %ld records dropped\n", dropped - log_reported);
+        log_reported = dropped;
+    }
+    if (n > 0) {
+        fflush(stdout);
+    }
+    funlockfile(stdout);
+    V(&log_mutex);
+    return n;
+}
+
+static void *log_thread(void *vargp) {
+    struct timespec deadline;
+
+    Pthread_detach(Pthread_self());
+    while (1) {
+        if (log_drain() > 0) {
+            continue;
+        }
+        __atomic_store_n(&log_idle, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (log_drain() == 0) {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += LOG_BACKSTOP;
+            while (sem_timedwait(&log_wake, &deadline) < 0 && errno == EINTR)
+                ;
+        }
+        __atomic_store_n(&log_idle, 0, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+void log_init(void) {
+    pthread_t tid;
+
+    Sem_init(&log_mutex, 0, 1);
+    Sem_init(&log_wake, 0, 0);
+    Pthread_create(&tid, NULL, log_thread, NULL);
+}
+
+/* Drain now, e.g. before exit */
+void log_flush(void) {
+    log_drain();
+}
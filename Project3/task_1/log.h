@@ -0,0 +1,34 @@
+/*
+ * log.h - asynchronous logger: per-thread rings drained by one thread
+ */
+#ifndef __LOG_H__
+#define __LOG_H__
+
+enum { LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR, LOG_OFF };
+
+#define LOG_MAXARGS 6
+#define LOG_RING 1024      /* Records per thread; must be a power of two */
+
+extern int log_level;
+extern long log_sample;
+
+/*
+ * Every conversion in fmt takes a long, and fmt must be a string literal:
+ * only the pointer and the arguments are recorded, and the drain thread
+ * formats them later. A disabled level costs one comparison.
+ */
+#define LOG(level, ...) do { \
+    if ((level) >= log_level) log_write((level), 0, __VA_ARGS__); \
+} while (0)
+
+/* Like LOG, but each thread keeps only one call in log_sample */
+#define LOG_SAMPLED(level, ...) do { \
+    if ((level) >= log_level) log_write((level), 1, __VA_ARGS__); \
+} while (0)
+
+int log_parse_level(const char *name);
+void log_init(void);
+void log_write(int level, int sampled, const char *fmt, ...);
+void log_flush(void);
+
+#endif /* __LOG_H__ */
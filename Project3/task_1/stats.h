@@ -0,0 +1,37 @@
+/*
+ * stats.h - per-thread server counters, summed when read
+ */
+#ifndef __STATS_H__
+#define __STATS_H__
+
+typedef struct stats {
+    struct stats *next;
+    long requests;
+    long shows, buys, failed_buys, sells;
+    long bytes_in, bytes_out;
+    long accepts;
+    long queued, queue_wait, queue_max_wait;   /* Connections off the worker queue; waits in usec */
+    long rw_reads, rw_read_wait;               /* Reader-writer lock acquisitions; waits in usec */
+    long rw_writes, rw_write_wait;
+    char pad[64];            /* Keep the next thread's block off this cache line */
+} stats_t;
+
+extern __thread stats_t *stats_mine;
+
+/* Only the owning thread writes its block, so a count is a plain add with no lock or RMW */
+#define STATS_ADD(field, n) do { \
+    stats_t *s_ = stats_mine ? stats_mine : stats_attach(); \
+    __atomic_store_n(&s_->field, s_->field + (n), __ATOMIC_RELAXED); \
+} while (0)
+
+#define STATS_MAX(field, n) do { \
+    stats_t *s_ = stats_mine ? stats_mine : stats_attach(); \
+    if ((n) > s_->field) { \
+        __atomic_store_n(&s_->field, (n), __ATOMIC_RELAXED); \
+    } \
+} while (0)
+
+stats_t *stats_attach(void);
+void stats_sum(stats_t *total);
+
+#endif /* __STATS_H__ */
@@ -3,27 +3,72 @@
  */
 /* $begin echoclientmain */
 #include "csapp.h"
+#include "client.h"
+
+#define MAX_WINDOW 64
 
 int main(int argc, char **argv) 
 {
-    int clientfd;
-    char *host, *port, buf[MAXLINE];
+    int clientfd, opt, mode = STREAM_FIXED, binary = 0, window = 1;
+    int ops[MAX_WINDOW], sent = 0, done = 0, quit = 0;
+    char *host, *port, buf[MAXLINE], reply[MAXLINE];
     rio_t rio;
+    bin_req req;
 
-    if (argc != 3) {
-	fprintf(stderr, "usage: %s <host> <port>\n", argv[0]);
+    while ((opt = getopt(argc, argv, "f:p:w:")) != -1) {
+	if (opt == 'w' && atoi(optarg) > 0 && atoi(optarg) <= MAX_WINDOW)
+	    window = atoi(optarg);
+	else if (opt == 'p' && !strcmp(optarg, "binary"))
+	    binary = 1;
+	else if (opt == 'p' && !strcmp(optarg, "text"))
+	    binary = 0;
+	else if (opt == 'f' && !strcmp(optarg, "length"))
+	    mode = STREAM_LENGTH;
+	else if (opt != 'f' || strcmp(optarg, "fixed"))
+	    optind = argc;
+    }
+    if (argc - optind != 2) {
+	fprintf(stderr, "usage: %s [-f fixed|length] [-p text|binary] [-w window] <host> <port>\n", argv[0]);
 	exit(0);
     }
-    host = argv[1];
-    port = argv[2];
+    host = argv[optind];
+    port = argv[optind + 1];
 
     clientfd = Open_clientfd(host, port);
     Rio_readinitb(&rio, clientfd);
+    if (binary)
+	start_binary(clientfd, &rio);
 
+    /* Up to window requests are in flight before the oldest reply is read */
     while (Fgets(buf, MAXLINE, stdin) != NULL) {
+	if ((quit = !strncmp(buf, "exit", 4)))
+	    break;
+	if (binary) {
+	    encode_request(buf, &req);
+	    Rio_writen(clientfd, &req, sizeof(req));
+	    ops[sent++ % window] = ntohl(req.op);
+	} else {
+	    Rio_writen(clientfd, buf, strlen(buf));
+	    sent++;
+	}
+	for (; sent - done >= window; done++) {
+	    if (binary)
+		read_binary_reply(&rio, ops[done % window]);
+	    else
+		read_reply(&rio, reply, mode);
+	}
+    }
+    for (; done < sent; done++) {
+	if (binary)
+	    read_binary_reply(&rio, ops[done % window]);
+	else
+	    read_reply(&rio, reply, mode);
+    }
+    if (quit && binary) {
+	encode_request(buf, &req);
+	Rio_writen(clientfd, &req, sizeof(req));
+    } else if (quit) {
 	Rio_writen(clientfd, buf, strlen(buf));
-	Rio_readlineb(&rio, buf, MAXLINE);
-	Fputs(buf, stdout);
     }
     Close(clientfd); //line:netp:echoclient:close
     exit(0);
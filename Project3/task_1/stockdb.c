@@ -0,0 +1,103 @@
+/*
+ * stockdb.c - memory-mapped file of fixed-width stock records
+ *
+ * The server maps the file shared and uses the records as its table:
+ * lookups are a binary search over the id-sorted array and trades change
+ * quantities in place. Opening costs the same for any catalog size, since
+ * pages are only read in as lookups touch them. The kernel may write
+ * dirty pages back at any time; db_sync() forces them out at checkpoints.
+ */
+#include "csapp.h"
+#include "stockdb.h"
+
+/* Write a new database through a tmp file, so a crash never leaves half of one */
+void db_create(const char *filename, StockRec *recs, int n) {
+    char tmp[MAXLINE];
+    StockDBHeader hdr;
+    int fd;
+
+    sprintf(tmp, "%s.tmp", filename);
+    fd = Open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    hdr.magic = STOCKDB_MAGIC;
+    hdr.n = n;
+    Rio_writen(fd, &hdr, sizeof(hdr));
+    Rio_writen(fd, recs, (size_t)n * sizeof(StockRec));
+    if (fsync(fd) < 0) {
+        unix_error("fsync error");
+    }
+    Close(fd);
+    if (rename(tmp, filename) < 0) {
+        unix_error("rename error");
+    }
+}
+
+/* Map filename; returns 0 if it does not exist yet */
+int db_open(StockDB *db, const char *filename) {
+    struct stat st;
+
+    if ((db->fd = open(filename, O_RDWR)) < 0) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        unix_error("db_open error");
+    }
+    Fstat(db->fd, &st);
+    db->size = st.st_size;
+    if (db->size < sizeof(StockDBHeader)) {
+        app_error("db_open: file too short");
+    }
+    db->hdr = Mmap(NULL, db->size, PROT_READ | PROT_WRITE, MAP_SHARED, db->fd, 0);
+    db->recs = (StockRec *)(db->hdr + 1);
+    db->n = db->hdr->n;
+    if (db->hdr->magic != STOCKDB_MAGIC
+        || db->size != sizeof(StockDBHeader) + (size_t)db->n * sizeof(StockRec)) {
+        app_error("db_open: not a stock database");
+    }
+    return 1;
+}
+
+StockRec *db_find(StockDB *db, int id) {
+    int lo = 0, hi = db->n - 1, mid;
+
+    while (lo <= hi) {
+        mid = lo + (hi - lo) / 2;
+        if (db->recs[mid].id == id) {
+            return &db->recs[mid];
+        }
+        if (db->recs[mid].id < id) {
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return NULL;
+}
+
+/* Overwrite n records in place, starting at slot */
+void db_write(int fd, int slot, StockRec *recs, int n) {
+    off_t off = sizeof(StockDBHeader) + (off_t)slot * sizeof(StockRec);
+    size_t len = (size_t)n * sizeof(StockRec), done;
+    ssize_t w;
+
+    for (done = 0; done < len; done += w) {
+        if ((w = pwrite(fd, (char *)recs + done, len - done, off + done)) < 0) {
+            if (errno == EINTR) {
+                w = 0;
+                continue;
+            }
+            unix_error("db_write error");
+        }
+    }
+}
+
+/* Return once every update made so far is on disk */
+void db_sync(StockDB *db) {
+    if (msync(db->hdr, db->size, MS_SYNC) < 0) {
+        unix_error("msync error");
+    }
+}
+
+void db_close(StockDB *db) {
+    Munmap(db->hdr, db->size);
+    Close(db->fd);
+}
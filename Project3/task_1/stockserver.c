@@ -1,99 +1,559 @@
 #include "csapp.h"
+#include "uring.h"
+#include "ebr.h"
+#include "version.h"
+#include "hash.h"
+#include "stream.h"
+#include "proto.h"
+#include "wal.h"
+#include "stockdb.h"
+#include "loader.h"
+#include "log.h"
+#include "stats.h"
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#define MAXEVENTS 1024
+#define URING_ENTRIES 1024
+#define URING_NBUFS 1024   /* Must be a power of two */
+#define URING_BUFSZ 4096
+#define URING_BGID 0
+#define MAXLEGS 64         /* Legs in one batch order */
+#define SNAP_PAGE 512      /* Records per snapshot page */
+#define SHOW_QTY 11        /* Widest quantity; show cache slots are sized for it */
+#define SHOW_PAGE 512      /* Records per show cache page */
+#define OUTQ_CAP (1 << 20) /* Default unsent reply bytes before a client is no longer read */
+
+enum { BACKEND_SELECT, BACKEND_EPOLL, BACKEND_URING };
+enum { INDEX_TREE, INDEX_FLAT, INDEX_HASH };
+enum { OP_ACCEPT = 1, OP_RECV, OP_SEND };   /* Low bits of cqe->user_data */
 
 typedef struct Stock {
     int id, quantity, price;
+    int rank;                  /* Position in id order: show cache line, stock.db slot */
+    int dirty;                 /* Changed since the last flush to stock.db */
+    struct hash_elem elem;
     struct Stock *left, *right;
 } Stock;
 
+/* One leg of a batch order; delta is the quantity change, negative for a buy */
+typedef struct {
+    int id, delta;
+    Stock *stock;
+    int *quantity;             /* In stock, or in the mapped record with -D */
+} Leg;
+
+/* A changed record and the stock.db slot it goes to */
+typedef struct {
+    int slot;
+    StockRec rec;
+} DirtyRec;
+
+/* Record i of a snapshot: a version of the table in id order, read without locks */
+#define SNAP_REC(snap, i) (((StockRec *)(snap)->pages[(i) / SNAP_PAGE]->data)[(i) % SNAP_PAGE])
+
+/* Flat index: stocks in one id-ordered array, searched through a separate key array */
+typedef struct {
+    int n;
+    Stock *records;   /* Stocks in id order; the tree is relinked over this array */
+    int *keys;        /* keys[1..n]: ids in Eytzinger (breadth-first) order */
+    int *slots;       /* slots[k]: index in records of keys[k] */
+    Stock **direct;   /* direct[id - min_id], used when ids are dense */
+    int min_id, span;
+} StockTable;
+
+/*
+ * Rendered show payload, one version page per SHOW_PAGE records. Record i
+ * has the fixed slot [off[i], off[i + 1]) of the whole payload.
+ */
+typedef struct {
+    int n;
+    int *off;
+    version_t *cur;
+} ShowCache;
+
+/* Bytes received but not yet served; a partial request waits here for the rest */
+typedef struct {
+    int binary;              /* Fixed-size bin_req frames since BIN_HELLO */
+    size_t off, len;         /* Unserved bytes are buf[off, len) */
+    char buf[MAXLINE];
+} inbuf_t;
+
+typedef struct {
+    int fd;
+    int writing;             /* Registered for EPOLLOUT */
+    inbuf_t in;
+    outq_t q;
+} client;
+
+typedef struct {
+    int fd;
+    int recv_armed, sending, closing, shut;
+    char *out;
+    char *sent_out;          /* Old out buffer, still read by the send in flight */
+    size_t outlen, outoff, outcap;
+    inbuf_t in;
+    outq_t held;             /* Received bytes not served while outq_cap replies are unsent */
+} uconn;
+
 typedef struct {
+    int backend;
+    int listenfd;
+    int nclients;
     int maxfd;
     fd_set read_set;
+    fd_set write_set;
     fd_set ready_set;
+    fd_set ready_wset;
     int nready;
     int maxi;
     int clientfd[FD_SETSIZE];
-    rio_t clientrio[FD_SETSIZE];
+    inbuf_t clientin[FD_SETSIZE];
+    outq_t clientq[FD_SETSIZE];
+    int epfd;
+    struct epoll_event events[MAXEVENTS];
+    uring ring;
+    uring_bufs bufs;
+    batch_t *batch;          /* Pending replies of the client being served */
 } pool;
 
 Stock *root = NULL;
+sem_t stock_sem;
+int snapshot_mode = 0;
+int index_mode = INDEX_TREE;
+StockTable table;
+struct hash stock_hash;
+int cache_mode = 0;
+int wal_mode = 0;
+int db_mode = 0;
+StockDB db;
+int persist_mode = 0;
+int persist_fd = -1;
+int *dirty_ids = NULL;        /* Stocks to write at the next flush */
+int ndirty = 0, dirty_cap = 0;
+sem_t flush_sem;              /* Held from collecting dirty records until they are on disk */
+int bgsave_period = -1;       /* Seconds between background snapshots; 0 = on request only */
+sem_t bgsave_sem;             /* Posted to request a background snapshot */
+pid_t bgsave_pid = 0;         /* Snapshot child still running */
+int reply_mode = STREAM_FIXED;
+size_t outq_cap = OUTQ_CAP;   /* A client with more unsent bytes is not read until they drain */
+ShowCache show_cache;
+version_t *snapshot = NULL;
+pool **reactors;
+int nreactors = 1;
+int active_clients = 0;
+struct timespec stats_last;   /* Time and accept count of the previous stats report */
+long stats_last_accepts = 0;
+sem_t stats_sem;
 
+void *reactor_thread(void *vargp);
+void run_reactor(pool *p);
+int open_reuseport_listenfd(char *port);
 void init_pool(int listenfd, pool *p);
+void count_client(pool *p, int delta);
+void request_save(void);
 void add_client(int connfd, pool *p);
+void log_connected(struct sockaddr_storage *addr);
+void set_nonblocking(int fd);
+void wait_clients(pool *p);
+int listen_ready(pool *p);
 void check_clients(pool *p);
-void parse_request(int connfd, char *buf);
+void check_slot(pool *p, int i);
+void watch_slot(pool *p, int i);
+void drop_slot(pool *p, int i);
+void serve_client(pool *p, client *c);
+void flush_client(pool *p, client *c);
+void watch_client(pool *p, client *c);
+int client_pending(client *c);
+void remove_client(pool *p, client *c);
+void raise_fd_limit(void);
+void uring_arm_accept(pool *p);
+void uring_arm_recv(pool *p, uconn *c);
+void uring_check_clients(pool *p);
+void uring_accepted(pool *p, int connfd);
+void uring_received(pool *p, uconn *c, char *data, size_t len);
+size_t uring_serve(uconn *c, const char *data, size_t len);
+int uring_waiting(uconn *c);
+void uring_stream_flush(stream_t *sp, const char *data, size_t len);
+void uring_flush(pool *p, uconn *c);
+void uring_drop(uconn *c);
+void uring_try_close(pool *p, uconn *c);
+int serve_requests(pool *p, int connfd, inbuf_t *in, outq_t *q);
+void init_requests(inbuf_t *in);
+void compact_requests(inbuf_t *in);
+int fill_requests(int fd, inbuf_t *in);
+size_t feed_requests(inbuf_t *in, const char *data, size_t len);
+size_t request_len(inbuf_t *in);
+int dispatch_request(inbuf_t *in, size_t n, stream_t *out);
+void execute_request(char *buf, stream_t *out);
+void start_binary(stream_t *out);
+void execute_binary(bin_req *req, stream_t *out);
+void show_stocks(stream_t *out);
+void print_stats(stream_t *out);
+void sigusr1_handler(int sig);
 Stock *load_stocks(const char *filename);
 Stock *make_stock(int id, int quantity, int price);
-Stock *insert_stock(Stock *root, Stock *new_stock);
+Stock *build_tree(StockRec *recs, int lo, int hi);
 Stock *find_stock(Stock *node, int id);
+Stock *tree_find(Stock *node, int id);
+void replay_logs(Stock **rootp);
+void replay_stock(int id, int quantity, void *aux);
+void log_stock(Stock *stock);
 void free_stock(Stock *node);
-void print_stocks(Stock *root, char *buf);
+void print_stocks(Stock *root, stream_t *out);
 int buy_stock(Stock *root, int id, int num);
 void sell_stock(Stock *root, int id, int num);
+int parse_legs(char *buf, Leg *legs);
+void find_leg(Leg *leg);
+int batch_order(Leg *legs, int n);
+int apply_legs(Leg *legs, int n);
 void save_stocks(const char *filename, Stock *root);
-int no_connections(pool *p);
+void write_stocks(Stock *root, const char *tmp, const char *filename);
+void create_db(const char *filename, const char *catalog);
+void print_records(stream_t *out);
+void *bgsave_thread(void *vargp);
+void bgsave(void);
+void bgsave_db(void);
+Stock *load_persisted(const char *filename);
+void mark_dirty(Stock *stock);
+DirtyRec *collect_dirty(int *np);
+void write_dirty(DirtyRec *recs, int n);
+int dirty_slot_cmp(const void *a, const void *b);
+void flush_dirty(void);
+int count_stocks(Stock *node);
+void build_table(Stock **rootp);
+void fill_records(Stock *node, Stock *records, int *i);
+Stock *link_records(Stock *records, int lo, int hi);
+void fill_keys(int k, int *i);
+Stock *table_find(int id);
+void free_table(void);
+void build_hash(Stock *node);
+unsigned stock_hash_func(const struct hash_elem *e, void *aux);
+bool stock_less_func(const struct hash_elem *a, const struct hash_elem *b, void *aux);
+void fill_ids(Stock *node, int *ids, int *i);
+void bench_lookups(Stock *root, long lookups);
+void build_show_cache(Stock *root);
+void size_stocks(Stock *node, int *i);
+void render_stocks(Stock *node, version_t *v);
+char *show_slot(version_t *v, int i);
+void fill_show_slot(char *slot, int width, Stock *stock);
+void patch_show_cache(Stock **stocks, int n);
+void write_show_cache(stream_t *out);
+version_t *new_snapshot(int n);
+void fill_snapshot(Stock *node, version_t *snap, int *i);
+void publish_snapshot(Stock *root);
+void publish_stocks(Stock **stocks, int n);
+void print_snapshot(stream_t *out);
 
 void sigint_handler(int sig) {
+    long enters = 0;
+    stats_t total;
+
+    log_flush();
+    for (int i = 0; i < nreactors; i++) {
+        if (reactors[i]->backend == BACKEND_URING) {
+            enters += reactors[i]->ring.enters;
+        }
+    }
+    if (enters) {
+        stats_sum(&total);
+        printf("%ld requests, %ld io_uring_enter calls\n", total.requests, enters);
+    }
+    if (wal_mode) {
+        long appends, syncs;
+        wal_stats(&appends, &syncs);
+        printf("wal: %ld appends, %ld syncs\n", appends, syncs);
+    }
+    if (persist_mode) {
+        P(&flush_sem);
+    }
+    P(&stock_sem);
+    if (bgsave_pid > 0) {
+        kill(bgsave_pid, SIGKILL);
+        waitpid(bgsave_pid, NULL, 0);
+    }
     save_stocks("stock.txt", root);
-    free_stock(root);
+    if (wal_mode) {
+        unlink("stock.log.old");
+    }
+    if (db_mode) {
+        db_close(&db);
+    } else if (index_mode == INDEX_FLAT) {
+        free_table();
+    } else {
+        free_stock(root);
+    }
     exit(0);
 }
 
 int main(int argc, char **argv) {
-    int listenfd, connfd;
-    socklen_t clientlen;
-    struct sockaddr_storage clientaddr;
-    char client_hostname[MAXLINE], client_port[MAXLINE];
-    static pool pool;
+    int opt, backend = BACKEND_SELECT;
+    long bench = 0;
+    sigset_t mask, prev_mask;
+    pthread_t *tids;
+
+    while ((opt = getopt(argc, argv, "b:n:si:B:cf:WS:DPo:L:R:")) != -1) {
+        if (opt == 'f' && !strcmp(optarg, "fixed")) {
+            reply_mode = STREAM_FIXED;
+        } else if (opt == 'f' && !strcmp(optarg, "length")) {
+            reply_mode = STREAM_LENGTH;
+        } else if (opt == 'W') {
+            wal_mode = 1;
+        } else if (opt == 'D') {
+            db_mode = 1;
+        } else if (opt == 'P') {
+            persist_mode = 1;
+        } else if (opt == 'S' && atoi(optarg) >= 0) {
+            bgsave_period = atoi(optarg);
+        } else if (opt == 'o' && atol(optarg) > 0) {
+            outq_cap = atol(optarg);
+        } else if (opt == 'L' && log_parse_level(optarg) >= 0) {
+            log_level = log_parse_level(optarg);
+        } else if (opt == 'R' && atol(optarg) > 0) {
+            log_sample = atol(optarg);
+        } else if (opt == 'c') {
+            cache_mode = 1;
+        } else if (opt == 'i' && !strcmp(optarg, "tree")) {
+            index_mode = INDEX_TREE;
+        } else if (opt == 'i' && !strcmp(optarg, "flat")) {
+            index_mode = INDEX_FLAT;
+        } else if (opt == 'i' && !strcmp(optarg, "hash")) {
+            index_mode = INDEX_HASH;
+        } else if (opt == 'B' && atol(optarg) > 0) {
+            bench = atol(optarg);
+        } else if (opt == 's') {
+            snapshot_mode = 1;
+        } else if (opt == 'b' && !strcmp(optarg, "select")) {
+            backend = BACKEND_SELECT;
+        } else if (opt == 'b' && !strcmp(optarg, "epoll")) {
+            backend = BACKEND_EPOLL;
+        } else if (opt == 'b' && !strcmp(optarg, "uring")) {
+            backend = BACKEND_URING;
+        } else if (opt == 'n' && atoi(optarg) > 0) {
+            nreactors = atoi(optarg);
+        } else {
+            optind = argc;
+            break;
+        }
+    }
+    if (optind != argc - 1 && !bench) {
+        fprintf(stderr, "usage: %s [-b select|epoll|uring] [-n reactors] [-s] [-i tree|flat|hash] [-B lookups] [-c] [-f fixed|length] [-W] [-S seconds] [-D] [-P] [-o bytes] [-L debug|info|warn|error|off] [-R sample] <port>\n", argv[0]);
+        exit(0);
+    }
 
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    Sem_init(&stock_sem, 0, 1);
+    Sem_init(&bgsave_sem, 0, 0);
+    Sem_init(&flush_sem, 0, 1);
+    Sem_init(&stats_sem, 0, 1);
+    clock_gettime(CLOCK_MONOTONIC, &stats_last);
+    if (db_mode && (snapshot_mode || cache_mode || index_mode != INDEX_TREE)) {
+        app_error("-D serves from the mapped file and cannot be combined with -s, -c or -i");
+    }
+    if (db_mode && persist_mode) {
+        app_error("-D and -P both keep stock.db; use one of them");
+    }
+    if (persist_mode && bgsave_period < 0) {
+        bgsave_period = 0;   /* Flushes run on the snapshot thread */
+    }
+    if (persist_mode) {
+        root = load_persisted("stock.db");
+    } else if (!db_mode) {
+        root = load_stocks("stock.txt");
+    } else {
+        if (!db_open(&db, "stock.db")) {
+            create_db("stock.db", "stock.txt");
+            db_open(&db, "stock.db");
+        }
+        printf("mapped %d stocks from stock.db\n", db.n);
+        if (wal_mode) {
+            replay_logs(&root);
+        }
+    }
+    if (wal_mode) {
+        wal_open("stock.log");
+    }
+    if (index_mode == INDEX_FLAT) {
+        build_table(&root);
+    } else if (index_mode == INDEX_HASH) {
+        hash_init(&stock_hash, stock_hash_func, stock_less_func, NULL);
+        build_hash(root);
+    }
+    if (bench) {
+        bench_lookups(root, bench);
         exit(0);
     }
+    if (cache_mode) {
+        build_show_cache(root);
+    }
+    if (snapshot_mode) {
+        publish_snapshot(root);
+    }
+
+    /* Each reactor owns a listening socket; the kernel spreads connections via SO_REUSEPORT */
+    reactors = Calloc(nreactors, sizeof(pool *));
+    for (int i = 0; i < nreactors; i++) {
+        reactors[i] = Calloc(1, sizeof(pool));
+        reactors[i]->backend = backend;
+        if (nreactors == 1) {
+            init_pool(Open_listenfd(argv[optind]), reactors[i]);
+        } else {
+            init_pool(open_reuseport_listenfd(argv[optind]), reactors[i]);
+        }
+    }
 
     Signal(SIGINT, sigint_handler);
+    Signal(SIGUSR1, sigusr1_handler);
+
+    /* Only the main thread takes SIGINT and SIGUSR1, so a handler never waits on a lock it holds */
+    Sigemptyset(&mask);
+    Sigaddset(&mask, SIGINT);
+    Sigaddset(&mask, SIGUSR1);
+    Sigprocmask(SIG_BLOCK, &mask, &prev_mask);
+    log_init();
+    tids = Malloc(nreactors * sizeof(pthread_t));
+    for (int i = 0; i < nreactors; i++) {
+        Pthread_create(&tids[i], NULL, reactor_thread, reactors[i]);
+    }
+    if (bgsave_period >= 0) {
+        pthread_t tid;
+        Pthread_create(&tid, NULL, bgsave_thread, NULL);
+    }
+    Sigprocmask(SIG_SETMASK, &prev_mask, NULL);
+    for (int i = 0; i < nreactors; i++) {
+        Pthread_join(tids[i], NULL);
+    }
+    exit(0);
+}
 
-    root = load_stocks("stock.txt");
-    listenfd = Open_listenfd(argv[1]);
-    init_pool(listenfd, &pool);
+void *reactor_thread(void *vargp) {
+    run_reactor((pool *)vargp);
+    return NULL;
+}
+
+void run_reactor(pool *p) {
+    int connfd;
+    socklen_t clientlen;
+    struct sockaddr_storage clientaddr;
 
     while (1) {
-        pool.ready_set = pool.read_set;
-        pool.nready = Select(pool.maxfd + 1, &pool.ready_set, NULL, NULL, NULL);
+        wait_clients(p);
 
-        if (FD_ISSET(listenfd, &pool.ready_set)) {
+        if (listen_ready(p)) {
             clientlen = sizeof(struct sockaddr_storage);
-            connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
-            Getnameinfo((SA *)&clientaddr, clientlen, client_hostname, MAXLINE, client_port, MAXLINE, 0);
-            printf("Connected to (%s, %s)\n", client_hostname, client_port);
-            add_client(connfd, &pool);
+            connfd = Accept(p->listenfd, (SA *)&clientaddr, &clientlen);
+            log_connected(&clientaddr);
+            add_client(connfd, p);
         }
 
-        check_clients(&pool);
+        check_clients(p);
+    }
+}
+
+/* open_listenfd with SO_REUSEPORT, so every reactor can bind the same port */
+int open_reuseport_listenfd(char *port) {
+    struct addrinfo hints, *listp, *p;
+    int listenfd = -1, optval = 1;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV;
+    Getaddrinfo(NULL, port, &hints, &listp);
 
-        if (no_connections(&pool)) {
-            save_stocks("stock.txt", root);
+    for (p = listp; p; p = p->ai_next) {
+        if ((listenfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0) {
+            continue;
         }
+        Setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, (const void *)&optval, sizeof(int));
+        Setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, (const void *)&optval, sizeof(int));
+        if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0) {
+            break;
+        }
+        Close(listenfd);
+    }
+
+    Freeaddrinfo(listp);
+    if (!p || listen(listenfd, LISTENQ) < 0) {
+        unix_error("open_reuseport_listenfd error");
     }
+    return listenfd;
 }
 
 void init_pool(int listenfd, pool *p) {
+    p->listenfd = listenfd;
+    p->nclients = 0;
+    p->nready = 0;
+    if (p->backend == BACKEND_URING) {
+        raise_fd_limit();
+        uring_init(&p->ring, URING_ENTRIES);
+        uring_bufs_init(&p->ring, &p->bufs, URING_BGID, URING_NBUFS, URING_BUFSZ);
+        uring_arm_accept(p);
+        return;
+    }
+    p->batch = Malloc(sizeof(batch_t));
+    if (p->backend == BACKEND_EPOLL) {
+        struct epoll_event ev;
+        raise_fd_limit();
+        if ((p->epfd = epoll_create1(0)) < 0) {
+            unix_error("epoll_create1 error");
+        }
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(p->epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0) {
+            unix_error("epoll_ctl error");
+        }
+        return;
+    }
     p->maxi = -1;
     for (int i = 0; i < FD_SETSIZE; i++) {
         p->clientfd[i] = -1;
     }
     p->maxfd = listenfd;
     FD_ZERO(&p->read_set);
+    FD_ZERO(&p->write_set);
     FD_ZERO(&p->ready_set);
+    FD_ZERO(&p->ready_wset);
     FD_SET(listenfd, &p->read_set);
 }
 
 void add_client(int connfd, pool *p) {
     int i;
+
+    STATS_ADD(accepts, 1);
+    if (p->backend == BACKEND_URING) {
+        uconn *c = Malloc(sizeof(uconn));
+        c->fd = connfd;
+        c->recv_armed = c->sending = c->closing = c->shut = 0;
+        c->out = c->sent_out = NULL;
+        c->outlen = c->outoff = c->outcap = 0;
+        init_requests(&c->in);
+        outq_init(&c->held);
+        uring_arm_recv(p, c);
+        count_client(p, 1);
+        return;
+    }
+    if (p->backend == BACKEND_EPOLL) {
+        struct epoll_event ev;
+        client *c = Malloc(sizeof(client));
+        c->fd = connfd;
+        c->writing = 0;
+        set_nonblocking(connfd);
+        init_requests(&c->in);
+        outq_init(&c->q);
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = c;
+        if (epoll_ctl(p->epfd, EPOLL_CTL_ADD, connfd, &ev) < 0) {
+            unix_error("epoll_ctl error");
+        }
+        count_client(p, 1);
+        return;
+    }
     p->nready--;
     for (i = 0; i < FD_SETSIZE; i++) {
         if (p->clientfd[i] < 0) {
             p->clientfd[i] = connfd;
-            Rio_readinitb(&p->clientrio[i], connfd);
+            set_nonblocking(connfd);
+            init_requests(&p->clientin[i]);
+            outq_init(&p->clientq[i]);
             FD_SET(connfd, &p->read_set);
             if (connfd > p->maxfd) {
                 p->maxfd = connfd;
@@ -101,6 +561,7 @@ void add_client(int connfd, pool *p) {
             if (i > p->maxi) {
                 p->maxi = i;
             }
+            count_client(p, 1);
             return;
         }
     }
@@ -108,162 +569,1536 @@ void add_client(int connfd, pool *p) {
     app_error("add_client error: Too many clients");
 }
 
-void check_clients(pool *p) {
-    int connfd, n;
-    char buf[MAXBUF];
-    rio_t *rio;
+/* The address goes to the log as numbers, with no DNS lookup on the accept path */
+void log_connected(struct sockaddr_storage *addr) {
+    struct sockaddr_in *sin = (struct sockaddr_in *)addr;
+    long ip;
 
-    for (int i = 0; (i <= p->maxi) && (p->nready > 0); i++) {
-        connfd = p->clientfd[i];
-        rio = &p->clientrio[i];
-        if ((connfd > 0) && (FD_ISSET(connfd, &p->ready_set))) {
-            p->nready--;
-            buf[0] = '\0';
-            n = Rio_readlineb(rio, buf, MAXBUF);
-            printf("server received %d bytes\n", (int)n);
-            if (n <= 0 || strncmp(buf, "exit", 4) == 0) {
-                Close(connfd);
-                FD_CLR(connfd, &p->read_set);
-                p->clientfd[i] = -1;
+    if (addr->ss_family != AF_INET) {
+        LOG(LOG_INFO, "Connected to (IPv6, %ld)", (long)ntohs(((struct sockaddr_in6 *)addr)->sin6_port));
+        return;
+    }
+    ip = ntohl(sin->sin_addr.s_addr);
+    LOG(LOG_INFO, "Connected to (%ld.%ld.%ld.%ld, %ld)",
+        ip >> 24, (ip >> 16) & 255, (ip >> 8) & 255, ip & 255, (long)ntohs(sin->sin_port));
+}
+
+/* Reads return what has arrived instead of waiting for a whole request */
+void set_nonblocking(int fd) {
+    int flags;
+
+    if ((flags = fcntl(fd, F_GETFL, 0)) < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        unix_error("fcntl error");
+    }
+}
+
+void count_client(pool *p, int delta) {
+    p->nclients += delta;
+    if (__atomic_add_fetch(&active_clients, delta, __ATOMIC_ACQ_REL) == 0 && delta < 0) {
+        request_save();
+    }
+}
+
+/* The last client left; save on the snapshot thread when there is one */
+void request_save(void) {
+    if (bgsave_period >= 0) {
+        V(&bgsave_sem);
+        return;
+    }
+    P(&stock_sem);
+    save_stocks("stock.txt", root);
+    V(&stock_sem);
+}
+
+void wait_clients(pool *p) {
+    if (p->backend == BACKEND_URING) {
+        uring_submit_and_wait(&p->ring, 1);
+        return;
+    }
+    if (p->backend == BACKEND_EPOLL) {
+        if ((p->nready = epoll_wait(p->epfd, p->events, MAXEVENTS, -1)) < 0) {
+            unix_error("epoll_wait error");
+        }
+        return;
+    }
+    p->ready_set = p->read_set;
+    p->ready_wset = p->write_set;
+    p->nready = Select(p->maxfd + 1, &p->ready_set, &p->ready_wset, NULL, NULL);
+}
+
+int listen_ready(pool *p) {
+    if (p->backend == BACKEND_URING) {
+        return 0;   /* Accepts arrive as completions in check_clients */
+    }
+    if (p->backend == BACKEND_EPOLL) {
+        for (int i = 0; i < p->nready; i++) {
+            if (p->events[i].data.ptr == NULL) {
+                return 1;
+            }
+        }
+        return 0;
+    }
+    return FD_ISSET(p->listenfd, &p->ready_set);
+}
+
+void check_clients(pool *p) {
+    if (p->backend == BACKEND_URING) {
+        uring_check_clients(p);
+        return;
+    }
+    if (p->backend == BACKEND_EPOLL) {
+        for (int i = 0; i < p->nready; i++) {
+            if (p->events[i].data.ptr == NULL) {
                 continue;
             }
-            parse_request(connfd, buf);
+            if (p->events[i].events & EPOLLOUT) {
+                flush_client(p, p->events[i].data.ptr);
+            } else {
+                serve_client(p, p->events[i].data.ptr);
+            }
+        }
+        return;
+    }
+
+    for (int i = 0; (i <= p->maxi) && (p->nready > 0); i++) {
+        if (p->clientfd[i] > 0) {
+            check_slot(p, i);
         }
     }
 }
 
-void parse_request(int connfd, char *buf) {
-    char order[20];
-    int id, num;
+void check_slot(pool *p, int i) {
+    int connfd = p->clientfd[i];
+    outq_t *q = &p->clientq[i];
 
-    if (!strncmp(buf, "show", 4)) {
-        buf[0] = '\0';
-        print_stocks(root, buf);
-        if (strlen(buf) == 0) {
-            strcpy(buf, "No stocks available\n");
-        } else {
-            buf[strlen(buf) - 1] = '\n';
+    if (FD_ISSET(connfd, &p->ready_wset)) {
+        p->nready--;
+        if (!outq_drain(q, connfd)) {
+            drop_slot(p, i);
+            return;
         }
-        Rio_writen(connfd, buf, MAXLINE);
-    } else if (!strncmp(buf, "buy", 3)) {
-        if (sscanf(buf, "%s %d %d", order, &id, &num) == 3) {
-            if (buy_stock(root, id, num)) {
-                strcpy(buf, "[buy] success\n");
+        /* Requests already buffered get no readiness event of their own */
+        if (!FD_ISSET(connfd, &p->ready_set) && outq_pending(q) < outq_cap
+            && request_len(&p->clientin[i]) > 0
+            && !serve_requests(p, connfd, &p->clientin[i], q)) {
+            drop_slot(p, i);
+            return;
+        }
+    }
+    if (FD_ISSET(connfd, &p->ready_set)) {
+        p->nready--;
+        if (!serve_requests(p, connfd, &p->clientin[i], q)) {
+            drop_slot(p, i);
+            return;
+        }
+    }
+    watch_slot(p, i);
+}
+
+/* Read a client only while its backlog is under the cap; watch for writability while it has one */
+void watch_slot(pool *p, int i) {
+    int connfd = p->clientfd[i];
+    size_t pending = outq_pending(&p->clientq[i]);
+
+    if (pending < outq_cap) {
+        FD_SET(connfd, &p->read_set);
+    } else {
+        FD_CLR(connfd, &p->read_set);
+    }
+    if (pending > 0) {
+        FD_SET(connfd, &p->write_set);
+    } else {
+        FD_CLR(connfd, &p->write_set);
+    }
+}
+
+void drop_slot(pool *p, int i) {
+    int connfd = p->clientfd[i];
+
+    Close(connfd);
+    FD_CLR(connfd, &p->read_set);
+    FD_CLR(connfd, &p->write_set);
+    outq_free(&p->clientq[i]);
+    p->clientfd[i] = -1;
+    count_client(p, -1);
+}
+
+void serve_client(pool *p, client *c) {
+    /* Edge-triggered: keep serving until neither c->in nor the socket holds more input,
+       or the client's backlog reaches the cap; flush_client resumes from there */
+    do {
+        if (outq_pending(&c->q) >= outq_cap) {
+            break;
+        }
+        if (!serve_requests(p, c->fd, &c->in, &c->q)) {
+            remove_client(p, c);
+            return;
+        }
+    } while (client_pending(c));
+    watch_client(p, c);
+}
+
+/* The socket has room again: send the backlog, then serve what waited behind it */
+void flush_client(pool *p, client *c) {
+    if (!outq_drain(&c->q, c->fd)) {
+        remove_client(p, c);
+        return;
+    }
+    if (outq_pending(&c->q) < outq_cap && client_pending(c)) {
+        serve_client(p, c);
+        return;
+    }
+    watch_client(p, c);
+}
+
+/* Ask for EPOLLOUT only while there is a backlog */
+void watch_client(pool *p, client *c) {
+    struct epoll_event ev;
+    int writing = outq_pending(&c->q) > 0;
+
+    if (writing == c->writing) {
+        return;
+    }
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET | (writing ? EPOLLOUT : 0);
+    ev.data.ptr = c;
+    if (epoll_ctl(p->epfd, EPOLL_CTL_MOD, c->fd, &ev) < 0) {
+        unix_error("epoll_ctl error");
+    }
+    c->writing = writing;
+}
+
+int client_pending(client *c) {
+    char ch;
+    if (request_len(&c->in) > 0) {
+        return 1;
+    }
+    return recv(c->fd, &ch, 1, MSG_PEEK | MSG_DONTWAIT) >= 0;
+}
+
+void remove_client(pool *p, client *c) {
+    epoll_ctl(p->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    Close(c->fd);
+    outq_free(&c->q);
+    Free(c);
+    count_client(p, -1);
+}
+
+void raise_fd_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+void uring_arm_accept(pool *p) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&p->ring);
+    uring_prep_accept_multishot(sqe, p->listenfd);
+    sqe->user_data = OP_ACCEPT;
+}
+
+void uring_arm_recv(pool *p, uconn *c) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&p->ring);
+    uring_prep_recv_multishot(sqe, c->fd, URING_BGID);
+    sqe->user_data = (unsigned long)c | OP_RECV;
+    c->recv_armed = 1;
+}
+
+void uring_check_clients(pool *p) {
+    struct io_uring_cqe *cqe;
+    uconn *c;
+    int res;
+    unsigned flags;
+
+    while ((cqe = uring_peek_cqe(&p->ring)) != NULL) {
+        c = (uconn *)(unsigned long)(cqe->user_data & ~3UL);
+        res = cqe->res;
+        flags = cqe->flags;
+
+        switch (cqe->user_data & 3) {
+        case OP_ACCEPT:
+            if (res >= 0) {
+                uring_accepted(p, res);
+            }
+            if (!(flags & IORING_CQE_F_MORE)) {
+                uring_arm_accept(p);
+            }
+            break;
+        case OP_RECV:
+            if (res > 0) {
+                unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+                uring_received(p, c, uring_buf(&p->bufs, bid), res);
+                uring_buf_recycle(&p->bufs, bid);
+            }
+            if (!(flags & IORING_CQE_F_MORE)) {
+                c->recv_armed = 0;
+                if ((res > 0 || res == -ENOBUFS) && !c->closing) {
+                    uring_arm_recv(p, c);
+                } else if (res != 0 || !uring_waiting(c)) {
+                    c->closing = 1;   /* On EOF, requests still held are served first */
+                }
+            }
+            uring_flush(p, c);
+            uring_try_close(p, c);
+            break;
+        case OP_SEND:
+            c->sending = 0;
+            Free(c->sent_out);
+            c->sent_out = NULL;
+            if (res < 0) {
+                c->closing = 1;
+                c->outlen = c->outoff = 0;
             } else {
-                strcpy(buf, "Not enough left stock\n");
+                c->outoff += res;
+                c->held.off += uring_serve(c, c->held.buf + c->held.off, outq_pending(&c->held));
+                if (!c->recv_armed && !uring_waiting(c)) {
+                    c->closing = 1;
+                }
             }
-        } else {
-            strcpy(buf, "Wrong Command!\n");
+            uring_flush(p, c);
+            uring_try_close(p, c);
+            break;
         }
-        Rio_writen(connfd, buf, MAXLINE);
-    } else if (!strncmp(buf, "sell", 4)) {
-        if (sscanf(buf, "%s %d %d", order, &id, &num) == 3) {
-            sell_stock(root, id, num);
-            strcpy(buf, "[sell] success\n");
-        } else {
-            strcpy(buf, "Wrong Command!\n");
+        uring_cqe_seen(&p->ring);
+    }
+}
+
+void uring_accepted(pool *p, int connfd) {
+    struct sockaddr_storage clientaddr;
+    socklen_t clientlen = sizeof(struct sockaddr_storage);
+
+    if (log_level <= LOG_INFO && getpeername(connfd, (SA *)&clientaddr, &clientlen) == 0) {
+        log_connected(&clientaddr);
+    }
+    add_client(connfd, p);
+}
+
+/*
+ * A multishot recv cannot be paused the way select and epoll stop reading,
+ * so while a client has outq_cap unsent reply bytes what it sends is held,
+ * up to outq_cap bytes, and served as its replies drain.
+ */
+void uring_received(pool *p, uconn *c, char *data, size_t len) {
+    size_t n = 0;
+
+    STATS_ADD(bytes_in, len);
+    if (outq_pending(&c->held) == 0) {
+        n = uring_serve(c, data, len);
+    }
+    if (n < len && !c->closing) {
+        if (outq_pending(&c->held) + len - n > outq_cap) {
+            uring_drop(c);
+            return;
         }
-        Rio_writen(connfd, buf, MAXLINE);
-    } else {
-        strcpy(buf, "Wrong Command!\n");
-        Rio_writen(connfd, buf, MAXLINE);
+        outq_append(&c->held, data + n, len - n);
     }
 }
 
-Stock *load_stocks(const char *filename) {
-    FILE *fp = Fopen(filename, "r");
-    Stock *root = NULL;
-    char line[100];
-    int id, quantity, price;
+/* Serve each complete request until outq_cap reply bytes are unsent; returns the data taken */
+size_t uring_serve(uconn *c, const char *data, size_t len) {
+    stream_t out;
+    size_t n, used = 0;
 
-    while (Fgets(line, sizeof(line), fp)) {
-        if (sscanf(line, "%d %d %d", &id, &quantity, &price) == 3) {
-            Stock *new_stock = make_stock(id, quantity, price);
-            root = insert_stock(root, new_stock);
+    while (!c->closing && c->outlen - c->outoff < outq_cap) {
+        if ((n = request_len(&c->in)) == 0) {
+            if (used == len) {
+                break;
+            }
+            used += feed_requests(&c->in, data + used, len - used);
+            continue;
         }
+        stream_init(&out, c->fd, c->in.binary ? STREAM_RAW : reply_mode);
+        out.flush = uring_stream_flush;
+        out.arg = c;
+        if (!dispatch_request(&c->in, n, &out)) {
+            c->closing = 1;
+        }
+        c->in.off += n;
     }
-    Fclose(fp);
-    return root;
+    return used;
 }
 
-Stock *make_stock(int id, int quantity, int price) {
-    Stock *new_stock = Malloc(sizeof(Stock));
-    new_stock->id = id;
-    new_stock->quantity = quantity;
-    new_stock->price = price;
-    new_stock->left = new_stock->right = NULL;
-    return new_stock;
+/* Requests arrived but not yet served */
+int uring_waiting(uconn *c) {
+    return outq_pending(&c->held) > 0 || request_len(&c->in) > 0;
 }
 
-Stock *insert_stock(Stock *root, Stock *new_stock) {
-    if (!root) return new_stock;
-    if (root->id < new_stock->id) {
-        root->right = insert_stock(root->right, new_stock);
-    } else if (root->id > new_stock->id) {
-        root->left = insert_stock(root->left, new_stock);
-    } else {
-        root->price = new_stock->price;
-        root->quantity = new_stock->quantity;
+/* Reply frames pile up in the connection's output buffer until uring_flush() */
+void uring_stream_flush(stream_t *sp, const char *data, size_t len) {
+    uconn *c = sp->arg;
+
+    STATS_ADD(bytes_out, len);
+    if (c->outlen + len > c->outcap) {
+        c->outcap = c->outcap ? 2 * c->outcap : 2 * MAXLINE;
+        if (c->outcap < c->outlen + len) {
+            c->outcap = c->outlen + len;
+        }
+        if (c->sending && c->sent_out == NULL) {
+            /* The kernel may still read the old buffer, so it cannot move */
+            c->sent_out = c->out;
+            c->out = Malloc(c->outcap);
+            memcpy(c->out, c->sent_out, c->outlen);
+        } else {
+            c->out = Realloc(c->out, c->outcap);
+        }
     }
-    return root;
+    memcpy(c->out + c->outlen, data, len);
+    c->outlen += len;
 }
 
-Stock *find_stock(Stock *node, int id) {
-    if (!node) return NULL;
-    if (node->id == id) {
-        return node;
+/* Queue one send for everything pending; it goes out with the next io_uring_enter */
+void uring_flush(pool *p, uconn *c) {
+    struct io_uring_sqe *sqe;
+
+    if (c->sending) {
+        return;
     }
-    if (node->id > id) {
-        return find_stock(node->left, id);
+    if (c->outoff == c->outlen) {
+        c->outoff = c->outlen = 0;
+        return;
     }
-    return find_stock(node->right, id);
+    if (wal_mode) {
+        wal_sync();
+    }
+    sqe = uring_get_sqe(&p->ring);
+    uring_prep_send(sqe, c->fd, c->out + c->outoff, c->outlen - c->outoff);
+    sqe->user_data = (unsigned long)c | OP_SEND;
+    c->sending = 1;
 }
 
-void free_stock(Stock *node) {
-    if (!node) return;
-    free_stock(node->left);
-    free_stock(node->right);
-    Free(node);
+/* Close a client that is too far behind; the shutdown fails a send it is not reading */
+void uring_drop(uconn *c) {
+    c->closing = 1;
+    if (!c->sending) {
+        c->outlen = c->outoff = 0;
+    }
+    if (!c->shut) {
+        shutdown(c->fd, SHUT_RDWR);
+        c->shut = 1;
+    }
 }
 
-void print_stocks(Stock *root, char *buf) {
-    if (!root) return;
-    char line[100];
-    print_stocks(root->left, buf);
-    sprintf(line, "%d %d %d\n", root->id, root->quantity, root->price);
-    strcat(buf, line);
-    print_stocks(root->right, buf);
+/* Free a closing connection once its send and multishot recv have both finished */
+void uring_try_close(pool *p, uconn *c) {
+    if (!c->closing || c->sending) {
+        return;
+    }
+    if (c->recv_armed) {
+        if (!c->shut) {
+            shutdown(c->fd, SHUT_RDWR);
+            c->shut = 1;
+        }
+        return;
+    }
+    Close(c->fd);
+    Free(c->out);
+    outq_free(&c->held);
+    Free(c);
+    count_client(p, -1);
 }
 
-int buy_stock(Stock *root, int id, int num) {
-    Stock *buy_stock = find_stock(root, id);
-    if (!buy_stock || buy_stock->quantity < num) {
-        return 0;
+/*
+ * Read what the socket has, run every request that is now complete and
+ * send all their replies with one writev. A partial request stays in in
+ * until the rest arrives, so a slow sender never blocks the loop. Replies
+ * the socket will not take without blocking wait in q. With -W nothing is
+ * sent before the trades behind it reach the log. Returns 0 once the
+ * client has left.
+ */
+int serve_requests(pool *p, int connfd, inbuf_t *in, outq_t *q) {
+    int open = fill_requests(connfd, in), alive = 1;
+    size_t n;
+
+    batch_init(p->batch, connfd);
+    p->batch->q = q;
+    if (wal_mode) {
+        p->batch->presend = wal_sync;
     }
-    buy_stock->quantity -= num;
-    return 1;
+    while (alive && outq_pending(q) < outq_cap && (n = request_len(in)) > 0) {
+        alive = dispatch_request(in, n, batch_next(p->batch, in->binary ? STREAM_RAW : reply_mode));
+        in->off += n;
+    }
+    batch_send(p->batch);
+    STATS_ADD(bytes_out, p->batch->bytes);
+    return open && alive && !q->failed;
 }
 
-void sell_stock(Stock *root, int id, int num) {
-    Stock *sell_stock = find_stock(root, id);
-    if (sell_stock) {
-        sell_stock->quantity += num;
+void init_requests(inbuf_t *in) {
+    in->binary = 0;
+    in->off = in->len = 0;
+}
+
+/* Move the unserved bytes to the front to make room behind them */
+void compact_requests(inbuf_t *in) {
+    if (in->off > 0) {
+        memmove(in->buf, in->buf + in->off, in->len - in->off);
+        in->len -= in->off;
+        in->off = 0;
     }
 }
 
-void save_stocks(const char *filename, Stock *root) {
-    FILE *fp = Fopen(filename, "w");
-    char buf[MAXBUF] = {0};
-    print_stocks(root, buf);
-    Fputs(buf, fp);
-    Fclose(fp);
+/* Read whatever the non-blocking socket has; returns 0 once the client has closed it */
+int fill_requests(int fd, inbuf_t *in) {
+    ssize_t n;
+
+    compact_requests(in);
+    if (in->len == sizeof(in->buf)) {
+        return 1;
+    }
+    while ((n = read(fd, in->buf + in->len, sizeof(in->buf) - in->len)) < 0 && errno == EINTR)
+        ;
+    if (n < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+    in->len += n;
+    STATS_ADD(bytes_in, n);
+    return n > 0;
+}
+
+/* Take as much of data as fits; returns how many bytes were taken */
+size_t feed_requests(inbuf_t *in, const char *data, size_t len) {
+    compact_requests(in);
+    if (len > sizeof(in->buf) - in->len) {
+        len = sizeof(in->buf) - in->len;
+    }
+    memcpy(in->buf + in->len, data, len);
+    in->len += len;
+    return len;
+}
+
+/* Size of the request at the front of in, or 0 while it is incomplete */
+size_t request_len(inbuf_t *in) {
+    size_t avail = in->len - in->off;
+    char *nl;
+
+    if (in->binary) {
+        return avail >= sizeof(bin_req) ? sizeof(bin_req) : 0;
+    }
+    if ((nl = memchr(in->buf + in->off, '\n', avail)) != NULL) {
+        return nl - (in->buf + in->off) + 1;
+    }
+    /* A line longer than the buffer is served in pieces, as rio did */
+    return avail == sizeof(in->buf) ? avail : 0;
 }
 
-int no_connections(pool *p) {
-    for (int i = 0; i <= p->maxi; i++) {
-        if (p->clientfd[i] != -1) {
+/* Run the n-byte request at the front of in, replying on out; returns 0 for exit */
+int dispatch_request(inbuf_t *in, size_t n, stream_t *out) {
+    char buf[MAXLINE + 1];
+    bin_req req;
+
+    if (in->binary) {
+        memcpy(&req, in->buf + in->off, sizeof(req));
+        if (ntohl(req.op) == BIN_EXIT) {
             return 0;
         }
+        out->binary = 1;
+        execute_binary(&req, out);
+        return 1;
+    }
+
+    memcpy(buf, in->buf + in->off, n);
+    buf[n] = '\0';
+    LOG_SAMPLED(LOG_INFO, "server received %ld bytes", (long)n);
+    if (strncmp(buf, "exit", 4) == 0) {
+        return 0;
+    }
+    if (!strcmp(buf, BIN_HELLO)) {
+        in->binary = 1;
+        start_binary(out);
+        return 1;
     }
+    execute_request(buf, out);
     return 1;
-}
\ No newline at end of file
+}
+
+/* Run the command in buf and write the reply frame(s) to out */
+void execute_request(char *buf, stream_t *out) {
+    char order[20];
+    int id, num, n;
+    Leg legs[MAXLEGS];
+
+    STATS_ADD(requests, 1);
+    if (!strncmp(buf, "show", 4)) {
+        show_stocks(out);
+        stream_end(out);
+        return;
+    }
+    if (!strncmp(buf, "stats", 5)) {
+        print_stats(out);
+        stream_end(out);
+        return;
+    }
+
+    P(&stock_sem);
+    if (!strncmp(buf, "buy", 3)) {
+        if (sscanf(buf, "%s %d %d", order, &id, &num) == 3) {
+            STATS_ADD(buys, 1);
+            if (buy_stock(root, id, num)) {
+                strcpy(buf, "[buy] success\n");
+            } else {
+                STATS_ADD(failed_buys, 1);
+                strcpy(buf, "Not enough left stock\n");
+            }
+        } else {
+            strcpy(buf, "Wrong Command!\n");
+        }
+    } else if (!strncmp(buf, "sell", 4)) {
+        if (sscanf(buf, "%s %d %d", order, &id, &num) == 3) {
+            STATS_ADD(sells, 1);
+            sell_stock(root, id, num);
+            strcpy(buf, "[sell] success\n");
+        } else {
+            strcpy(buf, "Wrong Command!\n");
+        }
+    } else if (!strncmp(buf, "bgsave", 6) && bgsave_period >= 0) {
+        V(&bgsave_sem);
+        strcpy(buf, "[bgsave] started\n");
+    } else if (!strncmp(buf, "batch", 5)) {
+        if ((n = parse_legs(buf + 5, legs)) < 0) {
+            strcpy(buf, "Wrong Command!\n");
+        } else if (batch_order(legs, n)) {
+            strcpy(buf, "[batch] success\n");
+        } else {
+            strcpy(buf, "Not enough left stock\n");
+        }
+    } else {
+        strcpy(buf, "Wrong Command!\n");
+    }
+    V(&stock_sem);
+    stream_puts(out, buf);
+    stream_end(out);
+}
+
+/* Acknowledge the switch to binary; out is unframed from here on */
+void start_binary(stream_t *out) {
+    out->mode = STREAM_RAW;
+    out->binary = 1;
+    stream_frame(out, BIN_OK, 0, 0, 0);
+    stream_end(out);
+}
+
+/* Binary counterpart of execute_request: fixed fields, no parsing */
+void execute_binary(bin_req *req, stream_t *out) {
+    int op = ntohl(req->op), id = ntohl(req->id), num = ntohl(req->quantity);
+    int status = BIN_OK;
+
+    STATS_ADD(requests, 1);
+    if (op == BIN_SHOW) {
+        show_stocks(out);
+        stream_frame(out, BIN_OK, 0, 0, 0);
+        stream_end(out);
+        return;
+    }
+
+    P(&stock_sem);
+    if (op == BIN_BUY) {
+        STATS_ADD(buys, 1);
+        if (!buy_stock(root, id, num)) {
+            STATS_ADD(failed_buys, 1);
+            status = BIN_SHORT;
+        }
+    } else if (op == BIN_SELL) {
+        STATS_ADD(sells, 1);
+        sell_stock(root, id, num);
+    } else {
+        status = BIN_BAD;
+    }
+    V(&stock_sem);
+    stream_frame(out, status, id, num, 0);
+    stream_end(out);
+}
+
+void show_stocks(stream_t *out) {
+    size_t total = out->total;
+
+    STATS_ADD(shows, 1);
+    /* Sync our trades now so the presend of each chunk finds nothing to write */
+    if (wal_mode) {
+        wal_sync();
+    }
+    if (snapshot_mode) {
+        print_snapshot(out);
+    } else if (cache_mode && !out->binary) {
+        write_show_cache(out);
+    } else {
+        P(&stock_sem);
+        if (db_mode) {
+            print_records(out);
+        } else {
+            print_stocks(root, out);
+        }
+        V(&stock_sem);
+    }
+    if (out->total == total && !out->binary) {
+        stream_puts(out, "No stocks available\n");
+    }
+}
+
+/* Counters summed over every thread; accepts/s covers the time since the previous report */
+void print_stats(stream_t *out) {
+    struct timespec now;
+    stats_t t;
+    double secs;
+    long accepts;
+
+    stats_sum(&t);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    P(&stats_sem);
+    secs = (now.tv_sec - stats_last.tv_sec) + (now.tv_nsec - stats_last.tv_nsec) / 1e9;
+    accepts = t.accepts - stats_last_accepts;
+    stats_last = now;
+    stats_last_accepts = t.accepts;
+    V(&stats_sem);
+
+    stream_printf(out, "requests %ld\n", t.requests);
+    stream_printf(out, "show %ld\nbuy %ld\nfailed buy %ld\nsell %ld\n",
+                  t.shows, t.buys, t.failed_buys, t.sells);
+    stream_printf(out, "bytes in %ld\nbytes out %ld\n", t.bytes_in, t.bytes_out);
+    stream_printf(out, "connections %d\n", __atomic_load_n(&active_clients, __ATOMIC_RELAXED));
+    stream_printf(out, "accepts %ld\naccepts/s %.1f\n", t.accepts, secs > 0 ? accepts / secs : 0.0);
+}
+
+/* Dump the stats to stdout without stopping the server */
+void sigusr1_handler(int sig) {
+    stream_t out;
+
+    stream_init(&out, STDOUT_FILENO, STREAM_RAW);
+    print_stats(&out);
+    stream_end(&out);
+}
+
+/* Parse the catalog in parallel, then build a balanced tree over the sorted records */
+Stock *load_stocks(const char *filename) {
+    struct timespec start, end;
+    StockRec *recs;
+    Stock *root;
+    long lines;
+    double secs;
+    int n;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    n = load_catalog(filename, &recs, &lines);
+    root = build_tree(recs, 0, n - 1);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    Free(recs);
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("loaded %d stocks from %s: %ld lines in %.3f s, %.0f lines/s\n",
+           n, filename, lines, secs, secs > 0 ? lines / secs : 0.0);
+    if (wal_mode) {
+        replay_logs(&root);
+    }
+    return root;
+}
+
+/* stock.log.old is left over when a crash interrupted a background snapshot */
+void replay_logs(Stock **rootp) {
+    long n = wal_replay("stock.log.old", replay_stock, rootp);
+    n += wal_replay("stock.log", replay_stock, rootp);
+    printf("replayed %ld trades from stock.log\n", n);
+}
+
+/* Trade log records carry absolute quantities */
+void replay_stock(int id, int quantity, void *aux) {
+    StockRec *rec;
+    Stock *stock;
+
+    if (db_mode) {
+        if ((rec = db_find(&db, id)) != NULL) {
+            rec->quantity = quantity;
+        }
+    } else if ((stock = tree_find(*(Stock **)aux, id)) != NULL) {
+        stock->quantity = quantity;
+        if (persist_mode) {
+            mark_dirty(stock);
+        }
+    }
+}
+
+Stock *make_stock(int id, int quantity, int price) {
+    Stock *new_stock = Malloc(sizeof(Stock));
+    new_stock->id = id;
+    new_stock->quantity = quantity;
+    new_stock->price = price;
+    new_stock->dirty = 0;
+    new_stock->left = new_stock->right = NULL;
+    return new_stock;
+}
+
+Stock *build_tree(StockRec *recs, int lo, int hi) {
+    int mid;
+    Stock *node;
+
+    if (lo > hi) return NULL;
+    mid = lo + (hi - lo) / 2;
+    node = make_stock(recs[mid].id, recs[mid].quantity, recs[mid].price);
+    node->rank = mid;
+    node->left = build_tree(recs, lo, mid - 1);
+    node->right = build_tree(recs, mid + 1, hi);
+    return node;
+}
+
+Stock *find_stock(Stock *node, int id) {
+    if (index_mode == INDEX_FLAT) {
+        return table_find(id);
+    }
+    if (index_mode == INDEX_HASH) {
+        Stock key;
+        struct hash_elem *e;
+        key.id = id;
+        e = hash_find(&stock_hash, &key.elem);
+        return e ? hash_entry(e, Stock, elem) : NULL;
+    }
+    return tree_find(node, id);
+}
+
+Stock *tree_find(Stock *node, int id) {
+    while (node && node->id != id) {
+        node = node->id > id ? node->left : node->right;
+    }
+    return node;
+}
+
+void free_stock(Stock *node) {
+    if (!node) return;
+    free_stock(node->left);
+    free_stock(node->right);
+    Free(node);
+}
+
+void print_stocks(Stock *root, stream_t *out) {
+    if (!root) return;
+    print_stocks(root->left, out);
+    stream_stock(out, root->id, root->quantity, root->price);
+    print_stocks(root->right, out);
+}
+
+int buy_stock(Stock *root, int id, int num) {
+    Stock *buy_stock;
+    if (db_mode) {
+        Leg leg = {id, -num};
+        return batch_order(&leg, 1);
+    }
+    buy_stock = find_stock(root, id);
+    if (!buy_stock || buy_stock->quantity < num) {
+        return 0;
+    }
+    buy_stock->quantity -= num;
+    if (wal_mode) {
+        log_stock(buy_stock);
+    }
+    if (persist_mode) {
+        mark_dirty(buy_stock);
+    }
+    if (snapshot_mode) {
+        publish_stocks(&buy_stock, 1);
+    }
+    if (cache_mode) {
+        patch_show_cache(&buy_stock, 1);
+    }
+    return 1;
+}
+
+void sell_stock(Stock *root, int id, int num) {
+    Stock *sell_stock;
+    if (db_mode) {
+        Leg leg = {id, num};
+        batch_order(&leg, 1);
+        return;
+    }
+    sell_stock = find_stock(root, id);
+    if (sell_stock) {
+        sell_stock->quantity += num;
+        if (wal_mode) {
+            log_stock(sell_stock);
+        }
+        if (persist_mode) {
+            mark_dirty(sell_stock);
+        }
+        if (snapshot_mode) {
+            publish_stocks(&sell_stock, 1);
+        }
+        if (cache_mode) {
+            patch_show_cache(&sell_stock, 1);
+        }
+    }
+}
+
+/* Parse "buy|sell <id> <num>" legs; returns the number of legs, or -1 */
+int parse_legs(char *buf, Leg *legs) {
+    char order[20];
+    int n = 0, id, num, used;
+
+    while (sscanf(buf, "%19s %d %d%n", order, &id, &num, &used) == 3) {
+        if (n == MAXLEGS || num < 0) {
+            return -1;
+        }
+        if (!strcmp(order, "buy")) {
+            legs[n].delta = -num;
+        } else if (!strcmp(order, "sell")) {
+            legs[n].delta = num;
+        } else {
+            return -1;
+        }
+        legs[n++].id = id;
+        buf += used;
+    }
+    buf += strspn(buf, " \t\r\n");
+    return (n > 0 && *buf == '\0') ? n : -1;
+}
+
+/* Apply all legs or none; the caller holds stock_sem */
+int batch_order(Leg *legs, int n) {
+    for (int i = 0; i < n; i++) {
+        find_leg(&legs[i]);
+    }
+    return apply_legs(legs, n);
+}
+
+/* Point the leg at the quantity it changes, in the tree or in the mapped file */
+void find_leg(Leg *leg) {
+    StockRec *rec;
+
+    if (db_mode) {
+        rec = db_find(&db, leg->id);
+        leg->stock = NULL;
+        leg->quantity = rec ? &rec->quantity : NULL;
+    } else {
+        leg->stock = find_stock(root, leg->id);
+        leg->quantity = leg->stock ? &leg->stock->quantity : NULL;
+    }
+}
+
+/* Legs run in order; a buy of a missing or short stock rolls back the earlier ones */
+int apply_legs(Leg *legs, int n) {
+    Stock *touched[MAXLEGS];
+    int i, ntouched = 0;
+
+    for (i = 0; i < n; i++) {
+        if (legs[i].quantity == NULL) {
+            if (legs[i].delta < 0) {
+                break;
+            }
+        } else if (*legs[i].quantity + legs[i].delta < 0) {
+            break;
+        } else {
+            *legs[i].quantity += legs[i].delta;
+        }
+    }
+    if (i < n) {
+        while (--i >= 0) {
+            if (legs[i].quantity) {
+                *legs[i].quantity -= legs[i].delta;
+            }
+        }
+        return 0;
+    }
+
+    if (wal_mode) {
+        char rec[MAXLEGS * 24];
+        int len = 0;
+        for (i = 0; i < n; i++) {
+            if (legs[i].quantity) {
+                len += sprintf(rec + len, "%d %d\n", legs[i].id, *legs[i].quantity);
+            }
+        }
+        if (len > 0) {
+            wal_append(rec, len);
+        }
+    }
+    for (i = 0; i < n; i++) {
+        if (legs[i].stock) {
+            touched[ntouched++] = legs[i].stock;
+        }
+        if (legs[i].stock && persist_mode) {
+            mark_dirty(legs[i].stock);
+        }
+    }
+    /* Readers see the whole basket or none of it */
+    if (ntouched > 0 && snapshot_mode) {
+        publish_stocks(touched, ntouched);
+    }
+    if (ntouched > 0 && cache_mode) {
+        patch_show_cache(touched, ntouched);
+    }
+    return 1;
+}
+
+/* With the trade log on, the file is replaced atomically and then the log is cut */
+void save_stocks(const char *filename, Stock *root) {
+    char tmp[MAXLINE];
+    FILE *fp;
+    stream_t out;
+
+    if (db_mode) {
+        db_sync(&db);
+        if (wal_mode) {
+            wal_truncate();
+        }
+        return;
+    }
+    if (persist_mode) {
+        DirtyRec *recs;
+        int n;
+        recs = collect_dirty(&n);
+        write_dirty(recs, n);
+        if (wal_mode) {
+            wal_truncate();
+        }
+        return;
+    }
+    if (wal_mode) {
+        sprintf(tmp, "%s.tmp", filename);
+        write_stocks(root, tmp, filename);
+        wal_truncate();
+        return;
+    }
+    fp = Fopen(filename, "w");
+    stream_init(&out, fileno(fp), STREAM_RAW);
+    print_stocks(root, &out);
+    stream_end(&out);
+    Fclose(fp);
+}
+
+/* Write the table to tmp, flush it to disk and rename it over filename */
+void write_stocks(Stock *root, const char *tmp, const char *filename) {
+    int fd = Open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    stream_t out;
+
+    stream_init(&out, fd, STREAM_RAW);
+    print_stocks(root, &out);
+    stream_end(&out);
+    if (fsync(fd) < 0) {
+        unix_error("fsync error");
+    }
+    Close(fd);
+    if (rename(tmp, filename) < 0) {
+        unix_error("rename error");
+    }
+}
+
+/* Convert the text catalog the first time the server runs with -D */
+void create_db(const char *filename, const char *catalog) {
+    StockRec *recs;
+    long lines;
+    int n = load_catalog(catalog, &recs, &lines);
+
+    db_create(filename, recs, n);
+    Free(recs);
+}
+
+void print_records(stream_t *out) {
+    for (int i = 0; i < db.n; i++) {
+        stream_stock(out, db.recs[i].id, db.recs[i].quantity, db.recs[i].price);
+    }
+}
+
+/* Take a background snapshot every bgsave_period seconds or when one is requested */
+void *bgsave_thread(void *vargp) {
+    struct timespec deadline;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        if (bgsave_period > 0) {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += bgsave_period;
+            while (sem_timedwait(&bgsave_sem, &deadline) < 0 && errno == EINTR)
+                ;
+        } else {
+            P(&bgsave_sem);
+        }
+        while (sem_trywait(&bgsave_sem) == 0)
+            ;   /* Requests queued meanwhile are covered by this snapshot */
+        bgsave();
+    }
+    return NULL;
+}
+
+/*
+ * Fork under the stock lock so the child sees a consistent copy-on-write
+ * view of the tree, and let it write stock.txt while the parent serves.
+ * Each page the parent then writes is copied by the kernel and shows up
+ * as a minor fault, so the parent's minor faults over the save estimate
+ * the copied pages. The count also takes in faults on fresh heap and
+ * stack pages, so it is an upper bound rather than an exact copy count.
+ */
+void bgsave(void) {
+    struct timespec start, forked, done;
+    struct rusage before, after;
+    int status = -1;
+    pid_t pid;
+
+    if (db_mode) {
+        bgsave_db();
+        return;
+    }
+    if (persist_mode) {
+        flush_dirty();
+        return;
+    }
+    getrusage(RUSAGE_SELF, &before);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    P(&stock_sem);
+    if (wal_mode) {
+        wal_rotate("stock.log.old");
+    }
+    if ((pid = Fork()) == 0) {
+        write_stocks(root, "stock.txt.bg", "stock.txt");
+        _exit(0);
+    }
+    bgsave_pid = pid;
+    V(&stock_sem);
+    clock_gettime(CLOCK_MONOTONIC, &forked);
+
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+        ;
+    clock_gettime(CLOCK_MONOTONIC, &done);
+    getrusage(RUSAGE_SELF, &after);
+
+    P(&stock_sem);
+    bgsave_pid = 0;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "bgsave: child failed, saving in the foreground\n");
+        save_stocks("stock.txt", root);
+    }
+    if (wal_mode) {
+        unlink("stock.log.old");
+    }
+    V(&stock_sem);
+    printf("bgsave: fork %ld us, total %ld us, %ld parent minor faults (est. pages copied)\n",
+           (forked.tv_sec - start.tv_sec) * 1000000 + (forked.tv_nsec - start.tv_nsec) / 1000,
+           (done.tv_sec - start.tv_sec) * 1000000 + (done.tv_nsec - start.tv_nsec) / 1000,
+           after.ru_minflt - before.ru_minflt);
+}
+
+/*
+ * The mapped file is already the snapshot; only its dirty pages need to
+ * reach disk. Trades that land after the log rotation may or may not be
+ * in the pages msync writes, but they are in the new log either way.
+ */
+void bgsave_db(void) {
+    struct timespec start, done;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (wal_mode) {
+        P(&stock_sem);
+        wal_rotate("stock.log.old");
+        V(&stock_sem);
+    }
+    db_sync(&db);
+    if (wal_mode) {
+        unlink("stock.log.old");
+    }
+    clock_gettime(CLOCK_MONOTONIC, &done);
+    printf("bgsave: msync %ld us\n",
+           (done.tv_sec - start.tv_sec) * 1000000 + (done.tv_nsec - start.tv_nsec) / 1000);
+}
+
+/* Rebuild the tree from stock.db, creating it from stock.txt the first time */
+Stock *load_persisted(const char *filename) {
+    StockDB file;
+    Stock *root;
+
+    if (!db_open(&file, filename)) {
+        create_db(filename, "stock.txt");
+        db_open(&file, filename);
+    }
+    root = build_tree(file.recs, 0, file.n - 1);
+    printf("loaded %d stocks from %s\n", file.n, filename);
+    db_close(&file);
+    persist_fd = Open(filename, O_WRONLY, 0);
+    if (wal_mode) {
+        replay_logs(&root);
+    }
+    return root;
+}
+
+/* Queue stock for the next flush; the caller holds stock_sem */
+void mark_dirty(Stock *stock) {
+    if (stock->dirty) return;
+    stock->dirty = 1;
+    if (ndirty == dirty_cap) {
+        dirty_cap = dirty_cap ? 2 * dirty_cap : 1024;
+        dirty_ids = Realloc(dirty_ids, dirty_cap * sizeof(int));
+    }
+    dirty_ids[ndirty++] = stock->id;
+}
+
+/* Copy out the dirty records and clear the set; the caller holds stock_sem */
+DirtyRec *collect_dirty(int *np) {
+    DirtyRec *recs = Malloc((ndirty + 1) * sizeof(DirtyRec));
+    Stock *stock;
+
+    for (int i = 0; i < ndirty; i++) {
+        stock = find_stock(root, dirty_ids[i]);
+        stock->dirty = 0;
+        recs[i].slot = stock->rank;
+        recs[i].rec.id = stock->id;
+        recs[i].rec.quantity = stock->quantity;
+        recs[i].rec.price = stock->price;
+    }
+    *np = ndirty;
+    ndirty = 0;
+    return recs;
+}
+
+/* Overwrite each record in place, one pwrite per run of adjacent slots */
+void write_dirty(DirtyRec *recs, int n) {
+    StockRec *run = Malloc((n + 1) * sizeof(StockRec));
+    int i, j;
+
+    qsort(recs, n, sizeof(DirtyRec), dirty_slot_cmp);
+    for (i = 0; i < n; i = j) {
+        for (j = i; j < n && recs[j].slot == recs[i].slot + (j - i); j++) {
+            run[j - i] = recs[j].rec;
+        }
+        db_write(persist_fd, recs[i].slot, run, j - i);
+    }
+    if (fdatasync(persist_fd) < 0) {
+        unix_error("fdatasync error");
+    }
+    Free(run);
+    Free(recs);
+}
+
+int dirty_slot_cmp(const void *a, const void *b) {
+    int x = ((DirtyRec *)a)->slot, y = ((DirtyRec *)b)->slot;
+    return (x > y) - (x < y);
+}
+
+/* Only the copy of the dirty records is made under the lock; the writes are not */
+void flush_dirty(void) {
+    struct timespec start, done;
+    DirtyRec *recs;
+    int n;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    P(&flush_sem);
+    P(&stock_sem);
+    if (wal_mode) {
+        wal_rotate("stock.log.old");
+    }
+    recs = collect_dirty(&n);
+    V(&stock_sem);
+    write_dirty(recs, n);
+    if (wal_mode) {
+        unlink("stock.log.old");
+    }
+    V(&flush_sem);
+    clock_gettime(CLOCK_MONOTONIC, &done);
+    printf("flush: %d records in %ld us\n", n,
+           (done.tv_sec - start.tv_sec) * 1000000 + (done.tv_nsec - start.tv_nsec) / 1000);
+}
+
+void log_stock(Stock *stock) {
+    char rec[32];
+    wal_append(rec, sprintf(rec, "%d %d\n", stock->id, stock->quantity));
+}
+
+int count_stocks(Stock *node) {
+    if (!node) return 0;
+    return count_stocks(node->left) + 1 + count_stocks(node->right);
+}
+
+/* A version of n records with private pages, not yet published */
+version_t *new_snapshot(int n) {
+    int npages = (n + SNAP_PAGE - 1) / SNAP_PAGE;
+    version_t *snap = version_new(n, npages);
+
+    for (int p = 0; p < npages; p++) {
+        version_page(snap, p, SNAP_PAGE * sizeof(StockRec));
+    }
+    return snap;
+}
+
+void fill_snapshot(Stock *node, version_t *snap, int *i) {
+    StockRec *rec;
+
+    if (!node) return;
+    fill_snapshot(node->left, snap, i);
+    rec = &SNAP_REC(snap, *i);
+    rec->id = node->id;
+    rec->quantity = node->quantity;
+    rec->price = node->price;
+    (*i)++;
+    fill_snapshot(node->right, snap, i);
+}
+
+void publish_snapshot(Stock *root) {
+    int i = 0;
+    version_t *snap = new_snapshot(count_stocks(root));
+
+    fill_snapshot(root, snap, &i);
+    version_publish(&snapshot, snap);
+}
+
+/*
+ * Publish one new version with every stock's quantity patched in. Only the
+ * pages holding those stocks are copied; the rest are shared with the old
+ * version. The caller holds stock_sem.
+ */
+void publish_stocks(Stock **stocks, int n) {
+    version_t *snap;
+    StockRec *recs;
+    int lo, hi, mid;
+
+    snap = version_copy(snapshot);
+    for (int k = 0; k < n; k++) {
+        for (lo = 0, hi = snap->n - 1; lo <= hi; ) {
+            mid = (lo + hi) / 2;
+            if (SNAP_REC(snap, mid).id == stocks[k]->id) {
+                recs = version_write(snap, mid / SNAP_PAGE);
+                recs[mid % SNAP_PAGE].quantity = stocks[k]->quantity;
+                break;
+            }
+            if (SNAP_REC(snap, mid).id < stocks[k]->id) {
+                lo = mid + 1;
+            } else {
+                hi = mid - 1;
+            }
+        }
+    }
+    version_publish(&snapshot, snap);
+}
+
+/* A slow reader holds only its own version, never the epoch */
+void print_snapshot(stream_t *out) {
+    version_t *snap = version_get(&snapshot);
+    StockRec *rec;
+
+    for (int i = 0; i < snap->n; i++) {
+        rec = &SNAP_REC(snap, i);
+        stream_stock(out, rec->id, rec->quantity, rec->price);
+    }
+    version_put(snap);
+}
+
+/* Batch-build the flat index and move every stock into one contiguous array */
+void build_table(Stock **rootp) {
+    long long span;
+    int i = 0;
+
+    table.n = count_stocks(*rootp);
+    table.records = Malloc((table.n + 1) * sizeof(Stock));
+    table.keys = Malloc((table.n + 1) * sizeof(int));
+    table.slots = Malloc((table.n + 1) * sizeof(int));
+    fill_records(*rootp, table.records, &i);
+    free_stock(*rootp);
+    *rootp = link_records(table.records, 0, table.n - 1);
+
+    i = 0;
+    fill_keys(1, &i);
+
+    table.direct = NULL;
+    if (table.n > 0) {
+        /* Wide, since ids at both ends of int overflow the span */
+        span = (long long)table.records[table.n - 1].id - table.records[0].id + 1;
+        if (span <= 2LL * table.n) {
+            table.min_id = table.records[0].id;
+            table.span = span;
+            table.direct = Calloc(table.span, sizeof(Stock *));
+            for (i = 0; i < table.n; i++) {
+                table.direct[table.records[i].id - table.min_id] = &table.records[i];
+            }
+        }
+    }
+}
+
+void fill_records(Stock *node, Stock *records, int *i) {
+    if (!node) return;
+    fill_records(node->left, records, i);
+    records[(*i)++] = *node;
+    fill_records(node->right, records, i);
+}
+
+/* Relink records[lo..hi] as a perfectly balanced tree for the in-order traversals */
+Stock *link_records(Stock *records, int lo, int hi) {
+    int mid;
+    Stock *node;
+
+    if (lo > hi) return NULL;
+    mid = lo + (hi - lo) / 2;
+    node = &records[mid];
+    node->left = link_records(records, lo, mid - 1);
+    node->right = link_records(records, mid + 1, hi);
+    return node;
+}
+
+void fill_keys(int k, int *i) {
+    if (k > table.n) return;
+    fill_keys(2 * k, i);
+    table.keys[k] = table.records[*i].id;
+    table.slots[k] = (*i)++;
+    fill_keys(2 * k + 1, i);
+}
+
+Stock *table_find(int id) {
+    int k = 1;
+
+    if (table.direct) {
+        if (id < table.min_id || (long long)id - table.min_id >= table.span) {
+            return NULL;
+        }
+        return table.direct[id - table.min_id];
+    }
+    while (k <= table.n) {
+        __builtin_prefetch(&table.keys[16 * k]);
+        k = 2 * k + (table.keys[k] < id);
+    }
+    k >>= __builtin_ffs(~k);
+    if (k == 0 || table.keys[k] != id) {
+        return NULL;
+    }
+    return &table.records[table.slots[k]];
+}
+
+void free_table(void) {
+    Free(table.records);
+    Free(table.keys);
+    Free(table.slots);
+    Free(table.direct);
+}
+
+/* The hash index only serves id lookups; show and save still walk the tree in order */
+void build_hash(Stock *node) {
+    if (!node) return;
+    build_hash(node->left);
+    hash_insert(&stock_hash, &node->elem);
+    build_hash(node->right);
+}
+
+unsigned stock_hash_func(const struct hash_elem *e, void *aux) {
+    return hash_int(hash_entry(e, Stock, elem)->id);
+}
+
+bool stock_less_func(const struct hash_elem *a, const struct hash_elem *b, void *aux) {
+    return hash_entry(a, Stock, elem)->id < hash_entry(b, Stock, elem)->id;
+}
+
+void fill_ids(Stock *node, int *ids, int *i) {
+    if (!node) return;
+    fill_ids(node->left, ids, i);
+    ids[(*i)++] = node->id;
+    fill_ids(node->right, ids, i);
+}
+
+/* Time find_stock() on random existing ids with the selected index, then exit */
+void bench_lookups(Stock *root, long lookups) {
+    int n = db_mode ? db.n : count_stocks(root), i = 0;
+    int *ids = Malloc((n + 1) * sizeof(int));
+    struct timespec start, end;
+    long found = 0;
+    double secs;
+
+    if (db_mode) {
+        for (i = 0; i < n; i++) {
+            ids[i] = db.recs[i].id;
+        }
+    } else {
+        fill_ids(root, ids, &i);
+    }
+    if (n == 0) {
+        ids[n++] = 0;
+    }
+    srand(1);
+    for (i = 0; i < n; i++) {
+        int j = rand() % n, tmp = ids[i];
+        ids[i] = ids[j];
+        ids[j] = tmp;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long k = 0; k < lookups; k++) {
+        if (db_mode) {
+            found += db_find(&db, ids[k % n]) != NULL;
+        } else {
+            found += find_stock(root, ids[k % n]) != NULL;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%s index: %d stocks, %ld lookups (%ld found) in %.3f s, %.1f ns/lookup\n",
+           db_mode ? "db" : index_mode == INDEX_FLAT ? "flat" : index_mode == INDEX_HASH ? "hash" : "tree",
+           db_mode ? db.n : count_stocks(root), lookups, found, secs, secs * 1e9 / lookups);
+    Free(ids);
+}
+
+void build_show_cache(Stock *root) {
+    int i = 0, npages, last;
+    version_t *v;
+
+    show_cache.n = count_stocks(root);
+    show_cache.off = Malloc((show_cache.n + 1) * sizeof(int));
+    show_cache.off[0] = 0;
+    size_stocks(root, &i);
+    npages = (show_cache.n + SHOW_PAGE - 1) / SHOW_PAGE;
+    v = version_new(show_cache.n, npages);
+    for (int p = 0; p < npages; p++) {
+        last = (p + 1) * SHOW_PAGE < show_cache.n ? (p + 1) * SHOW_PAGE : show_cache.n;
+        version_page(v, p, show_cache.off[last] - show_cache.off[p * SHOW_PAGE]);
+    }
+    render_stocks(root, v);
+    version_publish(&show_cache.cur, v);
+}
+
+/* Rank the stocks in id order and lay out their slots */
+void size_stocks(Stock *node, int *i) {
+    char line[40];
+    int width;
+
+    if (!node) return;
+    size_stocks(node->left, i);
+    node->rank = *i;
+    width = sprintf(line, "%d  %d\n", node->id, node->price) + SHOW_QTY;
+    show_cache.off[*i + 1] = show_cache.off[*i] + width;
+    (*i)++;
+    size_stocks(node->right, i);
+}
+
+void render_stocks(Stock *node, version_t *v) {
+    int i;
+
+    if (!node) return;
+    render_stocks(node->left, v);
+    i = node->rank;
+    fill_show_slot(show_slot(v, i), show_cache.off[i + 1] - show_cache.off[i], node);
+    render_stocks(node->right, v);
+}
+
+/* Where record i's slot lies in v; its page must already be private for a write */
+char *show_slot(version_t *v, int i) {
+    return v->pages[i / SHOW_PAGE]->data + show_cache.off[i] - show_cache.off[i / SHOW_PAGE * SHOW_PAGE];
+}
+
+/* The record, then spaces up to the newline that ends its slot */
+void fill_show_slot(char *slot, int width, Stock *stock) {
+    char line[40];
+    int len = sprintf(line, "%d %d %d", stock->id, stock->quantity, stock->price);
+
+    memcpy(slot, line, len);
+    memset(slot + len, ' ', width - 1 - len);
+    slot[width - 1] = '\n';
+}
+
+/* Publish the trade's records re-rendered in their slots as one version; the caller holds stock_sem */
+void patch_show_cache(Stock **stocks, int n) {
+    version_t *v = version_copy(show_cache.cur);
+    int i;
+
+    for (int k = 0; k < n; k++) {
+        i = stocks[k]->rank;
+        version_write(v, i / SHOW_PAGE);
+        fill_show_slot(show_slot(v, i), show_cache.off[i + 1] - show_cache.off[i], stocks[k]);
+    }
+    version_publish(&show_cache.cur, v);
+}
+
+/* The rendered pages go out as they are, with no lock held */
+void write_show_cache(stream_t *out) {
+    version_t *v = version_get(&show_cache.cur);
+
+    for (int p = 0; p < v->npages; p++) {
+        stream_write(out, v->pages[p]->data, v->pages[p]->size);
+    }
+    version_put(v);
+}
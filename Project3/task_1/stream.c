@@ -0,0 +1,278 @@
+/*
+ * stream.c - bounded output buffer for replies and stock file writes
+ *
+ * Output is flushed every MAXLINE bytes, so a reply or a save of any size
+ * takes constant memory. A STREAM_FIXED reply is a run of MAXLINE frames:
+ * every frame but the last is full text and the last one is NUL padded,
+ * so a reader keeps reading frames until one contains a NUL. A
+ * STREAM_LENGTH reply sends only the payload, as chunks that each start
+ * with a big-endian length; STREAM_MORE is set on all but the last chunk.
+ *
+ * A batch hands out one stream per pipelined request and keeps each
+ * finished reply in place, so the replies to everything a client sent
+ * together leave in a single writev.
+ *
+ * With an output queue attached, a batch is sent with one non-blocking
+ * sendmsg and whatever the socket does not take is copied to the queue.
+ * Once the queue holds anything, later replies go behind it so the
+ * client sees them in order; the event loop drains it on writability.
+ */
+#include "stream.h"
+#include "proto.h"
+
+void stream_fd_flush(stream_t *sp, const char *data, size_t len) {
+    Rio_writen(sp->fd, (void *)data, len);
+}
+
+void stream_init(stream_t *sp, int fd, int mode) {
+    sp->flush = stream_fd_flush;
+    sp->arg = NULL;
+    sp->fd = fd;
+    sp->mode = mode;
+    sp->binary = 0;
+    sp->last = 0;
+    sp->len = sp->total = 0;
+}
+
+/* Send the buffered payload as one frame or chunk */
+void stream_emit(stream_t *sp, int last) {
+    char *data = sp->buf + STREAM_HDR;
+    uint32_t hdr;
+
+    sp->last = last;
+    if (sp->mode == STREAM_LENGTH) {
+        hdr = htonl(sp->len | (last ? 0 : STREAM_MORE));
+        memcpy(sp->buf, &hdr, STREAM_HDR);
+        sp->flush(sp, sp->buf, STREAM_HDR + sp->len);
+    } else if (sp->mode == STREAM_FIXED) {
+        memset(data + sp->len, 0, MAXLINE - sp->len);
+        sp->flush(sp, data, MAXLINE);
+    } else if (sp->len > 0) {
+        sp->flush(sp, data, sp->len);
+    }
+    sp->len = 0;
+}
+
+void stream_write(stream_t *sp, const void *data, size_t len) {
+    const char *p = data;
+    size_t n;
+
+    sp->total += len;
+    while (len > 0) {
+        n = MAXLINE - sp->len;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(sp->buf + STREAM_HDR + sp->len, p, n);
+        sp->len += n;
+        p += n;
+        len -= n;
+        if (sp->len == MAXLINE) {
+            stream_emit(sp, 0);
+        }
+    }
+}
+
+void stream_puts(stream_t *sp, const char *str) {
+    stream_write(sp, str, strlen(str));
+}
+
+/* Formatted write of one short line (at most 127 bytes) */
+void stream_printf(stream_t *sp, const char *fmt, ...) {
+    char line[128];
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (n >= (int)sizeof(line)) {
+        n = sizeof(line) - 1;
+    }
+    stream_write(sp, line, n);
+}
+
+void stream_frame(stream_t *sp, int status, int id, int quantity, int price) {
+    bin_reply r;
+
+    r.status = htonl(status);
+    r.id = htonl(id);
+    r.quantity = htonl(quantity);
+    r.price = htonl(price);
+    stream_write(sp, &r, sizeof(r));
+}
+
+/* One show record, as a text line or a BIN_STOCK frame */
+void stream_stock(stream_t *sp, int id, int quantity, int price) {
+    if (sp->binary) {
+        stream_frame(sp, BIN_STOCK, id, quantity, price);
+    } else {
+        stream_printf(sp, "%d %d %d\n", id, quantity, price);
+    }
+}
+
+/* Flush what is left and close the reply */
+void stream_end(stream_t *sp) {
+    stream_emit(sp, 1);
+}
+
+void batch_init(batch_t *b, int fd) {
+    b->fd = fd;
+    b->q = NULL;
+    b->presend = NULL;
+    b->bytes = 0;
+    b->used = b->niov = 0;
+}
+
+/* A fresh stream for the next reply; sends the batch first if it is full */
+stream_t *batch_next(batch_t *b, int mode) {
+    stream_t *sp;
+
+    if (b->used == BATCH_MAX) {
+        batch_send(b);
+    }
+    sp = &b->out[b->used++];
+    stream_init(sp, b->fd, mode);
+    sp->flush = batch_flush;
+    sp->arg = b;
+    return sp;
+}
+
+/* Queue a chunk; a chunk that is not the last of its reply lives in a buffer
+   about to be reused, so it goes out right away */
+void batch_flush(stream_t *sp, const char *data, size_t len) {
+    batch_t *b = sp->arg;
+
+    b->iov[b->niov].iov_base = (void *)data;
+    b->iov[b->niov].iov_len = len;
+    b->niov++;
+    b->bytes += len;
+    if (!sp->last || b->niov == BATCH_MAX) {
+        batch_writev(b);
+    }
+}
+
+/* Send the queued chunks; streams keep their slots */
+void batch_writev(batch_t *b) {
+    struct iovec *iov = b->iov;
+    int n = b->niov;
+    ssize_t rc;
+
+    if (n == 0) {
+        return;
+    }
+    if (b->presend) {
+        b->presend();
+    }
+    if (b->q) {
+        outq_writev(b->q, b->fd, iov, n);
+        b->niov = 0;
+        return;
+    }
+    while (n > 0) {
+        if ((rc = writev(b->fd, iov, n)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            unix_error("writev error");
+        }
+        while (n > 0 && (size_t)rc >= iov->iov_len) {
+            rc -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *)iov->iov_base + rc;
+            iov->iov_len -= rc;
+        }
+    }
+    b->niov = 0;
+}
+
+void batch_send(batch_t *b) {
+    batch_writev(b);
+    b->used = 0;
+}
+
+void outq_init(outq_t *q) {
+    q->buf = NULL;
+    q->off = q->len = q->cap = 0;
+    q->failed = 0;
+}
+
+size_t outq_pending(outq_t *q) {
+    return q->len - q->off;
+}
+
+void outq_append(outq_t *q, const char *data, size_t len) {
+    if (q->len + len > q->cap && q->off > 0) {
+        memmove(q->buf, q->buf + q->off, q->len - q->off);
+        q->len -= q->off;
+        q->off = 0;
+    }
+    if (q->len + len > q->cap) {
+        q->cap = q->cap ? 2 * q->cap : 2 * MAXLINE;
+        if (q->cap < q->len + len) {
+            q->cap = q->len + len;
+        }
+        q->buf = Realloc(q->buf, q->cap);
+    }
+    memcpy(q->buf + q->len, data, len);
+    q->len += len;
+}
+
+/* Send what the socket takes now, unless earlier bytes are still queued, and queue the rest */
+void outq_writev(outq_t *q, int fd, struct iovec *iov, int n) {
+    struct msghdr msg;
+    ssize_t rc = 0;
+
+    if (q->failed || n == 0) {
+        return;
+    }
+    if (q->off == q->len) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+        while ((rc = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL)) < 0 && errno == EINTR)
+            ;
+        if (rc < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            q->failed = 1;
+            return;
+        }
+        if (rc < 0) {
+            rc = 0;
+        }
+    }
+    for (; n > 0; iov++, n--) {
+        if ((size_t)rc >= iov->iov_len) {
+            rc -= iov->iov_len;
+            continue;
+        }
+        outq_append(q, (char *)iov->iov_base + rc, iov->iov_len - rc);
+        rc = 0;
+    }
+}
+
+/* Send queued bytes until the socket would block; returns 0 once the peer is gone */
+int outq_drain(outq_t *q, int fd) {
+    ssize_t rc;
+
+    while (!q->failed && q->off < q->len) {
+        if ((rc = send(fd, q->buf + q->off, q->len - q->off, MSG_DONTWAIT | MSG_NOSIGNAL)) >= 0) {
+            q->off += rc;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 1;
+        } else if (errno != EINTR) {
+            q->failed = 1;
+        }
+    }
+    /* A slow client's backlog can be large; do not keep it around once sent */
+    outq_free(q);
+    return !q->failed;
+}
+
+void outq_free(outq_t *q) {
+    Free(q->buf);
+    q->buf = NULL;
+    q->off = q->len = q->cap = 0;
+}
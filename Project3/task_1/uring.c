@@ -0,0 +1,159 @@
+/*
+ * uring.c - minimal io_uring wrappers for the event-driven stock server
+ *
+ * Only what the server needs: ring setup, SQE/CQE handling, a provided
+ * buffer ring, and the accept/recv/send preparations.
+ */
+#include "csapp.h"
+#include "uring.h"
+#include <sys/syscall.h>
+
+void uring_init(uring *r, unsigned entries) {
+    struct io_uring_params params;
+    char *sq_ring, *cq_ring;
+    size_t sq_sz, cq_sz;
+
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = entries * 8;
+    if ((r->fd = syscall(__NR_io_uring_setup, entries, &params)) < 0) {
+        unix_error("io_uring_setup error");
+    }
+
+    sq_sz = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_sz = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        app_error("io_uring: kernel lacks IORING_FEAT_SINGLE_MMAP");
+    }
+    if (cq_sz > sq_sz) {
+        sq_sz = cq_sz;
+    }
+    sq_ring = Mmap(NULL, sq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQ_RING);
+    cq_ring = sq_ring;
+    r->sqes = Mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQES);
+
+    r->sq_head = (unsigned *)(sq_ring + params.sq_off.head);
+    r->sq_tail = (unsigned *)(sq_ring + params.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq_ring + params.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq_ring + params.sq_off.array);
+    r->cq_head = (unsigned *)(cq_ring + params.cq_off.head);
+    r->cq_tail = (unsigned *)(cq_ring + params.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq_ring + params.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq_ring + params.cq_off.cqes);
+    r->sq_entries = params.sq_entries;
+    r->sqe_head = r->sqe_tail = *r->sq_tail;
+    r->enters = 0;
+}
+
+struct io_uring_sqe *uring_get_sqe(uring *r) {
+    struct io_uring_sqe *sqe;
+
+    if (r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries) {
+        uring_submit_and_wait(r, 0);
+        if (r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries) {
+            app_error("io_uring: submission queue full");
+        }
+    }
+    sqe = &r->sqes[r->sqe_tail & *r->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sqe_tail++;
+    return sqe;
+}
+
+/* Submit every queued SQE and optionally wait, all in one io_uring_enter */
+void uring_submit_and_wait(uring *r, unsigned wait_nr) {
+    unsigned to_submit = r->sqe_tail - r->sqe_head;
+    unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+
+    for (; r->sqe_head != r->sqe_tail; r->sqe_head++) {
+        r->sq_array[r->sqe_head & *r->sq_mask] = r->sqe_head & *r->sq_mask;
+    }
+    __atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+
+    if (to_submit == 0 && wait_nr == 0) {
+        return;
+    }
+    r->enters++;
+    if (syscall(__NR_io_uring_enter, r->fd, to_submit, wait_nr, flags, NULL, 0) < 0
+        && errno != EINTR) {
+        unix_error("io_uring_enter error");
+    }
+}
+
+struct io_uring_cqe *uring_peek_cqe(uring *r) {
+    unsigned head = *r->cq_head;
+
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &r->cqes[head & *r->cq_mask];
+}
+
+void uring_cqe_seen(uring *r) {
+    __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+void uring_bufs_init(uring *r, uring_bufs *b, unsigned short bgid,
+                     unsigned nbufs, unsigned bufsz) {
+    struct io_uring_buf_reg reg;
+
+    b->br = Mmap(NULL, nbufs * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                 MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    b->bufs = Malloc((size_t)nbufs * bufsz);
+    b->nbufs = nbufs;
+    b->bufsz = bufsz;
+    b->bgid = bgid;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)b->br;
+    reg.ring_entries = nbufs;
+    reg.bgid = bgid;
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        unix_error("io_uring_register error");
+    }
+
+    b->br->tail = 0;
+    for (unsigned i = 0; i < nbufs; i++) {
+        uring_buf_recycle(b, i);
+    }
+}
+
+char *uring_buf(uring_bufs *b, unsigned bid) {
+    return b->bufs + (size_t)bid * b->bufsz;
+}
+
+/* Hand buffer bid back to the kernel */
+void uring_buf_recycle(uring_bufs *b, unsigned bid) {
+    unsigned short tail = b->br->tail;
+    struct io_uring_buf *buf = &b->br->bufs[tail & (b->nbufs - 1)];
+
+    buf->addr = (unsigned long)uring_buf(b, bid);
+    buf->len = b->bufsz;
+    buf->bid = bid;
+    __atomic_store_n(&b->br->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+void uring_prep_accept_multishot(struct io_uring_sqe *sqe, int fd) {
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+void uring_prep_recv_multishot(struct io_uring_sqe *sqe, int fd, unsigned short bgid) {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = bgid;
+}
+
+void uring_prep_send(struct io_uring_sqe *sqe, int fd, const void *buf, unsigned len) {
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+}
@@ -0,0 +1,43 @@
+/*
+ * uring.h - minimal io_uring wrappers for the event-driven stock server
+ */
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <linux/io_uring.h>
+
+typedef struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sq_entries;
+    unsigned sqe_head, sqe_tail;   /* Locally queued, not yet submitted */
+    long enters;                   /* Number of io_uring_enter calls */
+} uring;
+
+/* Provided buffer ring used by buffer-select receives */
+typedef struct {
+    struct io_uring_buf_ring *br;
+    char *bufs;
+    unsigned nbufs, bufsz;
+    unsigned short bgid;
+} uring_bufs;
+
+void uring_init(uring *r, unsigned entries);
+struct io_uring_sqe *uring_get_sqe(uring *r);
+void uring_submit_and_wait(uring *r, unsigned wait_nr);
+struct io_uring_cqe *uring_peek_cqe(uring *r);
+void uring_cqe_seen(uring *r);
+
+void uring_bufs_init(uring *r, uring_bufs *b, unsigned short bgid,
+                     unsigned nbufs, unsigned bufsz);
+char *uring_buf(uring_bufs *b, unsigned bid);
+void uring_buf_recycle(uring_bufs *b, unsigned bid);
+
+void uring_prep_accept_multishot(struct io_uring_sqe *sqe, int fd);
+void uring_prep_recv_multishot(struct io_uring_sqe *sqe, int fd, unsigned short bgid);
+void uring_prep_send(struct io_uring_sqe *sqe, int fd, const void *buf, unsigned len);
+
+#endif /* __URING_H__ */
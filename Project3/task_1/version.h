@@ -0,0 +1,29 @@
+/*
+ * version.h - immutable paged versions shared with lock-free readers
+ */
+#ifndef __VERSION_H__
+#define __VERSION_H__
+
+/* One page of a version, shared by every later version that leaves it alone */
+typedef struct {
+    int refs;              /* Versions holding this page */
+    int size;              /* Bytes of data */
+    char data[];
+} vpage_t;
+
+typedef struct {
+    int refs;              /* Readers holding it, plus one while published */
+    int n;                 /* Items in it, for the owner */
+    int npages;
+    vpage_t *pages[];
+} version_t;
+
+version_t *version_new(int n, int npages);
+void *version_page(version_t *v, int p, int size);
+version_t *version_copy(version_t *old);
+void *version_write(version_t *v, int p);
+void version_publish(version_t **slot, version_t *v);
+version_t *version_get(version_t **slot);
+void version_put(void *ptr);
+
+#endif /* __VERSION_H__ */
@@ -0,0 +1,17 @@
+/*
+ * wal.h - append-only trade log with group commit
+ */
+#ifndef __WAL_H__
+#define __WAL_H__
+
+#include <stddef.h>
+
+void wal_open(const char *filename);
+void wal_append(const char *rec, size_t len);
+void wal_sync(void);
+void wal_truncate(void);
+void wal_rotate(const char *old);
+long wal_replay(const char *filename, void (*apply)(int id, int quantity, void *aux), void *aux);
+void wal_stats(long *appends, long *syncs);
+
+#endif /* __WAL_H__ */
@@ -0,0 +1,82 @@
+/*
+ * ebr.c - epoch-based reclamation for lock-free readers
+ *
+ * A reader announces the global epoch in its slot for as long as it may
+ * hold a shared pointer. The epoch only advances once every active reader
+ * has seen the current one, so memory retired in epoch e is unreachable
+ * once the global epoch reaches e + 2, and is then handed to the destroy
+ * function given to ebr_retire(). Callers serialize ebr_retire().
+ */
+#include "csapp.h"
+#include "ebr.h"
+
+typedef struct {
+    long state;                 /* (epoch << 1) | active */
+    char pad[64 - sizeof(long)];
+} ebr_slot;
+
+typedef struct retired {
+    void *ptr;
+    void (*destroy)(void *);
+    long epoch;
+    struct retired *next;
+} retired;
+
+long global_epoch = 0;
+ebr_slot ebr_slots[EBR_MAXTHREADS];
+int ebr_nslots = 0;
+retired *limbo = NULL;
+__thread int ebr_id = -1;
+
+void ebr_enter(void) {
+    if (ebr_id < 0) {
+        ebr_id = __atomic_fetch_add(&ebr_nslots, 1, __ATOMIC_RELAXED);
+        if (ebr_id >= EBR_MAXTHREADS) {
+            app_error("ebr_enter error: Too many threads");
+        }
+    }
+    long epoch = __atomic_load_n(&global_epoch, __ATOMIC_RELAXED);
+    __atomic_store_n(&ebr_slots[ebr_id].state, (epoch << 1) | 1, __ATOMIC_SEQ_CST);
+}
+
+void ebr_exit(void) {
+    __atomic_store_n(&ebr_slots[ebr_id].state, 0, __ATOMIC_RELEASE);
+}
+
+/* Advance the epoch if every active reader has caught up, then free what is safe */
+void ebr_collect(void) {
+    long epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    int nslots = __atomic_load_n(&ebr_nslots, __ATOMIC_ACQUIRE);
+    retired **pp = &limbo, *r;
+
+    for (int i = 0; i < nslots && i < EBR_MAXTHREADS; i++) {
+        long state = __atomic_load_n(&ebr_slots[i].state, __ATOMIC_SEQ_CST);
+        if ((state & 1) && (state >> 1) != epoch) {
+            goto reclaim;
+        }
+    }
+    __atomic_compare_exchange_n(&global_epoch, &epoch, epoch + 1, 0,
+                                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+
+reclaim:
+    while ((r = *pp) != NULL) {
+        if (r->epoch + 2 <= epoch) {
+            *pp = r->next;
+            r->destroy(r->ptr);
+            Free(r);
+        } else {
+            pp = &r->next;
+        }
+    }
+}
+
+void ebr_retire(void *ptr, void (*destroy)(void *)) {
+    retired *r = Malloc(sizeof(retired));
+    r->ptr = ptr;
+    r->destroy = destroy;
+    r->epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    r->next = limbo;
+    limbo = r;
+    ebr_collect();
+}
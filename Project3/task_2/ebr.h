@@ -0,0 +1,14 @@
+/*
+ * ebr.h - epoch-based reclamation for lock-free readers
+ */
+#ifndef __EBR_H__
+#define __EBR_H__
+
+#define EBR_MAXTHREADS 1024
+
+void ebr_enter(void);
+void ebr_exit(void);
+void ebr_retire(void *ptr, void (*destroy)(void *));
+void ebr_collect(void);
+
+#endif /* __EBR_H__ */
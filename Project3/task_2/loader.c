@@ -0,0 +1,183 @@
+/*
+ * loader.c - parallel parser for the text stock catalog
+ *
+ * The file is mapped and cut at line boundaries into one chunk per CPU.
+ * Each thread scans its chunk with a hand-written integer parser into an
+ * array of its own. The arrays are joined in file order and sorted by id
+ * unless they already are, which is the usual case since the server saves
+ * in id order. Of several lines with the same id the last one wins, as it
+ * did when every line was inserted into the tree in turn.
+ */
+#include "csapp.h"
+#include "loader.h"
+
+#define LOADER_MAXTHREADS 16
+#define LOADER_MINCHUNK (1 << 20)   /* Smaller files are not worth another thread */
+
+typedef struct {
+    const char *p, *end;
+    StockRec *recs;
+    int n, cap;
+    long lines;
+} chunk_t;
+
+/* Parse one integer between *pp and end, skipping blanks before it */
+static int scan_int(const char **pp, const char *end, int *val) {
+    const char *p = *pp;
+    long v = 0;
+    int neg = 0;
+
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) {
+        p++;
+    }
+    if (p < end && (*p == '-' || *p == '+')) {
+        neg = *p++ == '-';
+    }
+    if (p == end || *p < '0' || *p > '9') {
+        return 0;
+    }
+    while (p < end && *p >= '0' && *p <= '9') {
+        v = v * 10 + (*p++ - '0');
+    }
+    *val = neg ? -v : v;
+    *pp = p;
+    return 1;
+}
+
+/* Lines that do not start with three integers are skipped, as sscanf did */
+static void *scan_chunk(void *vargp) {
+    chunk_t *c = vargp;
+    const char *p = c->p, *nl;
+    int id, quantity, price;
+
+    c->cap = (c->end - c->p) / 16 + 16;
+    c->recs = Malloc(c->cap * sizeof(StockRec));
+    c->n = 0;
+    c->lines = 0;
+    while (p < c->end) {
+        if ((nl = memchr(p, '\n', c->end - p)) == NULL) {
+            nl = c->end;
+        }
+        c->lines++;
+        if (scan_int(&p, nl, &id) && scan_int(&p, nl, &quantity) && scan_int(&p, nl, &price)) {
+            if (c->n == c->cap) {
+                c->cap *= 2;
+                c->recs = Realloc(c->recs, c->cap * sizeof(StockRec));
+            }
+            c->recs[c->n].id = id;
+            c->recs[c->n].quantity = quantity;
+            c->recs[c->n].price = price;
+            c->n++;
+        }
+        p = nl + 1;
+    }
+    return NULL;
+}
+
+/* Stable, so duplicate ids stay in file order */
+static void sort_recs(StockRec *recs, int n) {
+    StockRec *tmp = Malloc(n * sizeof(StockRec)), *src = recs, *dst = tmp, *swap;
+    int width, lo, mid, hi, i, j, k;
+
+    for (width = 1; width < n; width *= 2) {
+        for (lo = 0; lo < n; lo += 2 * width) {
+            mid = lo + width < n ? lo + width : n;
+            hi = lo + 2 * width < n ? lo + 2 * width : n;
+            for (i = lo, j = mid, k = lo; k < hi; k++) {
+                if (i < mid && (j == hi || src[i].id <= src[j].id)) {
+                    dst[k] = src[i++];
+                } else {
+                    dst[k] = src[j++];
+                }
+            }
+        }
+        swap = src;
+        src = dst;
+        dst = swap;
+    }
+    if (src != recs) {
+        memcpy(recs, src, n * sizeof(StockRec));
+    }
+    Free(tmp);
+}
+
+/* Parse filename into id-sorted records with unique ids; returns how many */
+int load_catalog(const char *filename, StockRec **recsp, long *linesp) {
+    chunk_t chunks[LOADER_MAXTHREADS];
+    pthread_t tids[LOADER_MAXTHREADS];
+    int fd = Open(filename, O_RDONLY, 0);
+    int nthreads, n = 0, i, j;
+    char *map = NULL;
+    const char *cut;
+    struct stat st;
+    size_t size;
+    StockRec *recs;
+
+    Fstat(fd, &st);
+    size = st.st_size;
+    if (size > 0) {
+        map = Mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads > (int)(size / LOADER_MINCHUNK)) {
+        nthreads = size / LOADER_MINCHUNK;
+    }
+    if (nthreads > LOADER_MAXTHREADS) {
+        nthreads = LOADER_MAXTHREADS;
+    }
+    if (nthreads < 1) {
+        nthreads = 1;
+    }
+    for (i = 0; i < nthreads; i++) {
+        chunks[i].p = i == 0 ? map : chunks[i - 1].end;
+        cut = map + size / nthreads * (i + 1);
+        if (i == nthreads - 1 || cut <= chunks[i].p) {
+            cut = i == nthreads - 1 ? map + size : chunks[i].p;
+        } else if ((cut = memchr(cut, '\n', map + size - cut)) == NULL) {
+            cut = map + size;
+        } else {
+            cut++;
+        }
+        chunks[i].end = cut;
+    }
+    for (i = 1; i < nthreads; i++) {
+        Pthread_create(&tids[i], NULL, scan_chunk, &chunks[i]);
+    }
+    scan_chunk(&chunks[0]);
+    for (i = 1; i < nthreads; i++) {
+        Pthread_join(tids[i], NULL);
+    }
+
+    *linesp = 0;
+    for (i = 0; i < nthreads; i++) {
+        n += chunks[i].n;
+        *linesp += chunks[i].lines;
+    }
+    recs = Malloc((n + 1) * sizeof(StockRec));
+    for (i = 0, n = 0; i < nthreads; i++) {
+        memcpy(recs + n, chunks[i].recs, chunks[i].n * sizeof(StockRec));
+        n += chunks[i].n;
+        Free(chunks[i].recs);
+    }
+    if (map) {
+        Munmap(map, size);
+    }
+    Close(fd);
+
+    for (i = 1; i < n && recs[i - 1].id < recs[i].id; i++)
+        ;
+    if (i < n) {
+        sort_recs(recs, n);
+        for (i = 0, j = 0; i < n; i++) {
+            if (j > 0 && recs[j - 1].id == recs[i].id) {
+                recs[j - 1] = recs[i];
+            } else {
+                recs[j++] = recs[i];
+            }
+        }
+        n = j;
+    }
+    *recsp = recs;
+    return n;
+}
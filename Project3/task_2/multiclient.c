@@ -1,28 +1,44 @@
 #include "csapp.h"
+#include "client.h"
 #include <time.h>
 
 #define MAX_CLIENT 100
 #define ORDER_PER_CLIENT 10
 #define STOCK_NUM 10
 #define BUY_SELL_MAX 10
+#define MAX_WINDOW ORDER_PER_CLIENT
 
 int main(int argc, char **argv) 
 {
 	pid_t pids[MAX_CLIENT];
 	int runprocess = 0, status, i;
 
-	int clientfd, num_client;
+	int clientfd, num_client, opt, mode = STREAM_FIXED, binary = 0;
+	int window = 1, ops[MAX_WINDOW], done;
 	char *host, *port, buf[MAXLINE], tmp[3];
+	bin_req req;
 	rio_t rio;
 
-	if (argc != 4) {
-		fprintf(stderr, "usage: %s <host> <port> <client#>\n", argv[0]);
+	while ((opt = getopt(argc, argv, "f:p:w:")) != -1) {
+		if (opt == 'w' && atoi(optarg) > 0 && atoi(optarg) <= MAX_WINDOW)
+			window = atoi(optarg);
+		else if (opt == 'p' && !strcmp(optarg, "binary"))
+			binary = 1;
+		else if (opt == 'p' && !strcmp(optarg, "text"))
+			binary = 0;
+		else if (opt == 'f' && !strcmp(optarg, "length"))
+			mode = STREAM_LENGTH;
+		else if (opt != 'f' || strcmp(optarg, "fixed"))
+			optind = argc;
+	}
+	if (argc - optind != 3) {
+		fprintf(stderr, "usage: %s [-f fixed|length] [-p text|binary] [-w window] <host> <port> <client#>\n", argv[0]);
 		exit(0);
 	}
 
-	host = argv[1];
-	port = argv[2];
-	num_client = atoi(argv[3]);
+	host = argv[optind];
+	port = argv[optind + 1];
+	num_client = atoi(argv[optind + 2]);
 
 /*	fork for each client process	*/
 	while(runprocess < num_client){
@@ -37,9 +53,12 @@ int main(int argc, char **argv)
 
 			clientfd = Open_clientfd(host, port);
 			Rio_readinitb(&rio, clientfd);
+			if (binary)
+				start_binary(clientfd, &rio);
 			srand((unsigned int) getpid());
 
-			for(i=0;i<ORDER_PER_CLIENT;i++){
+			/* send window orders back to back, then read their replies */
+			for(i=0, done=0;i<ORDER_PER_CLIENT;i++){
 				int option = rand() % 3;
 				
 				if(option == 0){//show
@@ -71,10 +90,22 @@ int main(int argc, char **argv)
 				}
 				//strcpy(buf, "buy 1 2\n");
 			
-				Rio_writen(clientfd, buf, strlen(buf));
-				// Rio_readlineb(&rio, buf, MAXLINE);
-				Rio_readnb(&rio, buf, MAXLINE);
-				Fputs(buf, stdout);
+				if (binary) {
+					encode_request(buf, &req);
+					Rio_writen(clientfd, &req, sizeof(req));
+					ops[i] = ntohl(req.op);
+				} else {
+					Rio_writen(clientfd, buf, strlen(buf));
+				}
+				if (i + 1 - done < window && i + 1 < ORDER_PER_CLIENT)
+					continue;
+
+				for (; done <= i; done++) {
+					if (binary)
+						read_binary_reply(&rio, ops[done]);
+					else
+						read_reply(&rio, buf, mode);
+				}
 
 				usleep(1000000);
 			}
@@ -0,0 +1,39 @@
+/*
+ * proto.h - binary wire protocol for stock orders
+ *
+ * A connection starts out in text mode. Sending the line "binary\n"
+ * switches it: the server answers with one BIN_OK reply frame, and from
+ * then on every request is a bin_req and every reply a run of bin_reply
+ * frames. A show reply is one BIN_STOCK frame per stock followed by a
+ * BIN_OK frame; every other reply is a single frame. All fields are in
+ * network byte order.
+ */
+#ifndef __PROTO_H__
+#define __PROTO_H__
+
+#include <stdint.h>
+
+#define BIN_HELLO "binary\n"
+
+/* Request opcodes */
+enum { BIN_SHOW = 1, BIN_BUY, BIN_SELL, BIN_EXIT };
+
+/* Reply status */
+enum {
+    BIN_OK,        /* Trade done, or end of a show */
+    BIN_STOCK,     /* One show record */
+    BIN_SHORT,     /* Not enough left stock */
+    BIN_BAD        /* Unknown opcode */
+};
+
+typedef struct {
+    uint32_t op;
+    int32_t id, quantity;
+} bin_req;
+
+typedef struct {
+    uint32_t status;
+    int32_t id, quantity, price;
+} bin_reply;
+
+#endif /* __PROTO_H__ */
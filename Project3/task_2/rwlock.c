@@ -0,0 +1,90 @@
+/*
+ * rwlock.c - semaphore-based readers-writers lock with a selectable policy
+ *
+ * RW_READER_PREF is the first readers-writers solution: writers may starve.
+ * RW_WRITER_PREF lets a waiting writer close the gate to new readers.
+ * RW_FAIR makes readers and writers pass one turnstile in arrival order.
+ * Acquisitions and wait times go to the calling thread's stats block.
+ */
+#include "rwlock.h"
+#include "stats.h"
+
+static long now_usec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+void rwlock_init(rwlock_t *rw, int policy) {
+    rw->policy = policy;
+    rw->readcnt = rw->writecnt = 0;
+    Sem_init(&rw->mutex, 0, 1);
+    Sem_init(&rw->wmutex, 0, 1);
+    Sem_init(&rw->w, 0, 1);
+    Sem_init(&rw->r, 0, 1);
+    Sem_init(&rw->queue, 0, 1);
+}
+
+void read_lock(rwlock_t *rw) {
+    long start = now_usec();
+
+    if (rw->policy == RW_WRITER_PREF) {
+        P(&rw->r);
+    } else if (rw->policy == RW_FAIR) {
+        P(&rw->queue);
+    }
+    P(&rw->mutex);
+    if (++rw->readcnt == 1) {
+        P(&rw->w);
+    }
+    V(&rw->mutex);
+    if (rw->policy == RW_WRITER_PREF) {
+        V(&rw->r);
+    } else if (rw->policy == RW_FAIR) {
+        V(&rw->queue);
+    }
+
+    STATS_ADD(rw_reads, 1);
+    STATS_ADD(rw_read_wait, now_usec() - start);
+}
+
+void read_unlock(rwlock_t *rw) {
+    P(&rw->mutex);
+    if (--rw->readcnt == 0) {
+        V(&rw->w);
+    }
+    V(&rw->mutex);
+}
+
+void write_lock(rwlock_t *rw) {
+    long start = now_usec();
+
+    if (rw->policy == RW_WRITER_PREF) {
+        P(&rw->wmutex);
+        if (++rw->writecnt == 1) {
+            P(&rw->r);
+        }
+        V(&rw->wmutex);
+        P(&rw->w);
+    } else if (rw->policy == RW_FAIR) {
+        P(&rw->queue);
+        P(&rw->w);
+        V(&rw->queue);
+    } else {
+        P(&rw->w);
+    }
+
+    STATS_ADD(rw_writes, 1);
+    STATS_ADD(rw_write_wait, now_usec() - start);
+}
+
+void write_unlock(rwlock_t *rw) {
+    V(&rw->w);
+    if (rw->policy == RW_WRITER_PREF) {
+        P(&rw->wmutex);
+        if (--rw->writecnt == 0) {
+            V(&rw->r);
+        }
+        V(&rw->wmutex);
+    }
+}
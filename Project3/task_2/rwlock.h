@@ -0,0 +1,28 @@
+/*
+ * rwlock.h - semaphore-based readers-writers lock with a selectable policy
+ */
+#ifndef __RWLOCK_H__
+#define __RWLOCK_H__
+
+#include "csapp.h"
+
+enum { RW_READER_PREF, RW_WRITER_PREF, RW_FAIR };
+
+typedef struct {
+    int policy;
+    int readcnt;       /* Readers currently inside */
+    int writecnt;      /* Writers waiting or inside (writer preference) */
+    sem_t mutex;       /* Protects readcnt */
+    sem_t wmutex;      /* Protects writecnt */
+    sem_t w;           /* Held by one writer or by the group of readers */
+    sem_t r;           /* Closed by waiting writers (writer preference) */
+    sem_t queue;       /* Arrival-order turnstile (fair) */
+} rwlock_t;
+
+void rwlock_init(rwlock_t *rw, int policy);
+void read_lock(rwlock_t *rw);
+void read_unlock(rwlock_t *rw);
+void write_lock(rwlock_t *rw);
+void write_unlock(rwlock_t *rw);
+
+#endif /* __RWLOCK_H__ */
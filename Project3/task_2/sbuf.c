@@ -0,0 +1,52 @@
+/*
+ * sbuf.c - bounded queue of connected descriptors shared by the worker threads
+ */
+#include "sbuf.h"
+
+static long now_usec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/* Create an empty, bounded, shared FIFO buffer with n slots */
+void sbuf_init(sbuf_t *sp, int n) {
+    sp->buf = Calloc(n, sizeof(int));
+    sp->stamp = Calloc(n, sizeof(long));
+    sp->n = n;
+    sp->front = sp->rear = 0;
+    Sem_init(&sp->mutex, 0, 1);
+    Sem_init(&sp->slots, 0, n);
+    Sem_init(&sp->items, 0, 0);
+}
+
+/* Clean up buffer sp */
+void sbuf_deinit(sbuf_t *sp) {
+    Free(sp->buf);
+    Free(sp->stamp);
+}
+
+/* Insert item onto the rear of shared buffer sp, blocking while it is full */
+void sbuf_insert(sbuf_t *sp, int item) {
+    P(&sp->slots);
+    P(&sp->mutex);
+    sp->rear = (sp->rear + 1) % sp->n;
+    sp->buf[sp->rear] = item;
+    sp->stamp[sp->rear] = now_usec();
+    V(&sp->mutex);
+    V(&sp->items);
+}
+
+/* Remove and return the first item from buffer sp; *wait is how long it queued (usec) */
+int sbuf_remove(sbuf_t *sp, long *wait) {
+    int item;
+
+    P(&sp->items);
+    P(&sp->mutex);
+    sp->front = (sp->front + 1) % sp->n;
+    item = sp->buf[sp->front];
+    *wait = now_usec() - sp->stamp[sp->front];
+    V(&sp->mutex);
+    V(&sp->slots);
+    return item;
+}
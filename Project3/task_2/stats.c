@@ -0,0 +1,51 @@
+/*
+ * stats.c - per-thread server counters, summed when read
+ *
+ * Every thread that counts something gets its own block, linked into a
+ * list the first time. Counting never writes memory another thread
+ * writes, so it costs the same with one thread or a hundred; a reader
+ * walks the list and adds the blocks up. A sum taken while requests run
+ * is not one instant, but each counter in it is exact up to that point.
+ */
+#include "csapp.h"
+#include "stats.h"
+
+stats_t *stats_list = NULL;
+__thread stats_t *stats_mine = NULL;
+
+stats_t *stats_attach(void) {
+    stats_t *s = Calloc(1, sizeof(stats_t));
+
+    s->next = __atomic_load_n(&stats_list, __ATOMIC_ACQUIRE);
+    while (!__atomic_compare_exchange_n(&stats_list, &s->next, s, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+        ;
+    return stats_mine = s;
+}
+
+void stats_sum(stats_t *total) {
+    stats_t *s;
+    long max;
+
+    memset(total, 0, sizeof(*total));
+    for (s = __atomic_load_n(&stats_list, __ATOMIC_ACQUIRE); s; s = s->next) {
+        total->requests += __atomic_load_n(&s->requests, __ATOMIC_RELAXED);
+        total->shows += __atomic_load_n(&s->shows, __ATOMIC_RELAXED);
+        total->buys += __atomic_load_n(&s->buys, __ATOMIC_RELAXED);
+        total->failed_buys += __atomic_load_n(&s->failed_buys, __ATOMIC_RELAXED);
+        total->sells += __atomic_load_n(&s->sells, __ATOMIC_RELAXED);
+        total->bytes_in += __atomic_load_n(&s->bytes_in, __ATOMIC_RELAXED);
+        total->bytes_out += __atomic_load_n(&s->bytes_out, __ATOMIC_RELAXED);
+        total->accepts += __atomic_load_n(&s->accepts, __ATOMIC_RELAXED);
+        total->queued += __atomic_load_n(&s->queued, __ATOMIC_RELAXED);
+        total->queue_wait += __atomic_load_n(&s->queue_wait, __ATOMIC_RELAXED);
+        total->rw_reads += __atomic_load_n(&s->rw_reads, __ATOMIC_RELAXED);
+        total->rw_read_wait += __atomic_load_n(&s->rw_read_wait, __ATOMIC_RELAXED);
+        total->rw_writes += __atomic_load_n(&s->rw_writes, __ATOMIC_RELAXED);
+        total->rw_write_wait += __atomic_load_n(&s->rw_write_wait, __ATOMIC_RELAXED);
+        max = __atomic_load_n(&s->queue_max_wait, __ATOMIC_RELAXED);
+        if (max > total->queue_max_wait) {
+            total->queue_max_wait = max;
+        }
+    }
+}
@@ -0,0 +1,37 @@
+/*
+ * stockdb.h - memory-mapped file of fixed-width stock records
+ */
+#ifndef __STOCKDB_H__
+#define __STOCKDB_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define STOCKDB_MAGIC 0x53544b31   /* "STK1" */
+
+typedef struct {
+    int32_t id, quantity, price;
+} StockRec;
+
+/* File layout: this header, then n records sorted by id */
+typedef struct {
+    uint32_t magic;
+    int32_t n;
+} StockDBHeader;
+
+typedef struct {
+    int fd;
+    size_t size;
+    StockDBHeader *hdr;
+    StockRec *recs;            /* Points into the shared mapping */
+    int n;
+} StockDB;
+
+void db_create(const char *filename, StockRec *recs, int n);
+int db_open(StockDB *db, const char *filename);
+StockRec *db_find(StockDB *db, int id);
+void db_write(int fd, int slot, StockRec *recs, int n);
+void db_sync(StockDB *db);
+void db_close(StockDB *db);
+
+#endif /* __STOCKDB_H__ */
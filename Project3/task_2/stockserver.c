@@ -1,104 +1,508 @@
 #include "csapp.h"
+#include "sbuf.h"
+#include "rwlock.h"
+#include "ebr.h"
+#include "version.h"
+#include "hash.h"
+#include "stream.h"
+#include "proto.h"
+#include "wal.h"
+#include "stockdb.h"
+#include "loader.h"
+#include "log.h"
+#include "stats.h"
+#include <limits.h>
+#include <sys/resource.h>
+
+#define NTHREADS 100
+#define SBUFSIZE 128
+#define MAXLEGS 64         /* Legs in one batch order */
+#define SNAP_PAGE 512      /* Records per snapshot page */
+#define SHOW_QTY 11        /* Widest quantity; show cache slots are sized for it */
+#define SHOW_PAGE 512      /* Records per show cache page */
+#define SHOW_CHUNK 512     /* Records copied per table lock hold in show */
+
+enum { LOCK_GLOBAL, LOCK_STOCK, LOCK_RW };
+enum { INDEX_TREE, INDEX_FLAT, INDEX_HASH };
 
 typedef struct Stock {
     int id, quantity, price;
+    int rank;                  /* Position in id order: show cache line, stock.db slot */
+    int dirty;                 /* Changed since the last flush to stock.db */
+    struct hash_elem elem;
+    sem_t mutex;
     struct Stock *left, *right;
 } Stock;
 
+/* One leg of a batch order; delta is the quantity change, negative for a buy */
+typedef struct {
+    int id, delta;
+    Stock *stock;
+    int *quantity;             /* In stock, or in the mapped record with -D */
+} Leg;
+
+/* A changed record and the stock.db slot it goes to */
+typedef struct {
+    int slot;
+    StockRec rec;
+} DirtyRec;
+
+/* Record i of a snapshot: a version of the table in id order, read without locks */
+#define SNAP_REC(snap, i) (((StockRec *)(snap)->pages[(i) / SNAP_PAGE]->data)[(i) % SNAP_PAGE])
+
+/* Flat index: stocks in one id-ordered array, searched through a separate key array */
+typedef struct {
+    int n;
+    Stock *records;   /* Stocks in id order; the tree is relinked over this array */
+    int *keys;        /* keys[1..n]: ids in Eytzinger (breadth-first) order */
+    int *slots;       /* slots[k]: index in records of keys[k] */
+    Stock **direct;   /* direct[id - min_id], used when ids are dense */
+    int min_id, span;
+} StockTable;
+
+/*
+ * Rendered show payload, one version page per SHOW_PAGE records. Record i
+ * has the fixed slot [off[i], off[i + 1]) of the whole payload.
+ */
+typedef struct {
+    int n;
+    int *off;
+    version_t *cur;
+} ShowCache;
+
 Stock *root = NULL;
 sem_t stock_sem;
+rwlock_t stock_rw;
+int lock_mode = LOCK_GLOBAL;
+int snapshot_mode = 0;
+int index_mode = INDEX_TREE;
+StockTable table;
+struct hash stock_hash;
+int cache_mode = 0;
+int wal_mode = 0;
+int db_mode = 0;
+StockDB db;
+int persist_mode = 0;
+int persist_fd = -1;
+int *dirty_ids = NULL;        /* Stocks to write at the next flush */
+int ndirty = 0, dirty_cap = 0;
+sem_t dirty_sem;              /* Protects dirty_ids when trades hold only per-stock locks */
+sem_t flush_sem;              /* Held from collecting dirty records until they are on disk */
+int active_clients = 0;      /* Workers serving a connection */
+int open_clients = 0;        /* Accepted and not yet closed, queued ones included */
+int nworkers = NTHREADS;
+struct timespec stats_last;   /* Time and accept count of the previous stats report */
+long stats_last_accepts = 0;
+sem_t stats_sem;
+int bgsave_period = -1;       /* Seconds between background snapshots; 0 = on request only */
+sem_t bgsave_sem;             /* Posted to request a background snapshot */
+pid_t bgsave_pid = 0;         /* Snapshot child still running */
+int reply_mode = STREAM_FIXED;
+ShowCache show_cache;
+sem_t show_sem;
+version_t *snapshot = NULL;
+sem_t snapshot_sem;
+sbuf_t sbuf;
 
-void *client_thread(void *vargp);
-void parse_request(int connfd, char *buf);
+void *worker_thread(void *vargp);
+void log_connected(struct sockaddr_storage *addr);
+void serve_client(int connfd, batch_t *b);
+int request_ready(rio_t *rio, int binary);
+void send_replies(batch_t *b);
+void print_queue_stats(void);
+void print_lock_stats(void);
+void parse_request(stream_t *out, char *buf);
+void parse_binary(stream_t *out, bin_req *req);
+void show_stocks(stream_t *out);
+void print_stats(stream_t *out);
+void sigusr1_handler(int sig);
+void lock_table(void);
+void unlock_table(void);
+void lock_stocks(Stock *node);
+void unlock_stocks(Stock *node);
+Stock *lock_stock(Stock *root, int id);
+void unlock_stock(Stock *stock);
+int stock_id_cmp(const void *a, const void *b);
+int lock_legs(Leg *legs, int n, Stock **locked);
+void unlock_legs(Stock **locked, int nlocked);
 Stock *load_stocks(const char *filename);
 Stock *make_stock(int id, int quantity, int price);
-Stock *insert_stock(Stock *root, Stock *new_stock);
+Stock *build_tree(StockRec *recs, int lo, int hi);
 Stock *find_stock(Stock *node, int stock_id);
+Stock *tree_find(Stock *node, int id);
+void replay_logs(Stock **rootp);
+void replay_stock(int id, int quantity, void *aux);
+void log_stock(Stock *stock);
 void free_stock(Stock *node);
-void print_stocks(Stock *root, char *buf);
+void print_stocks(Stock *root, stream_t *out);
+int copy_stocks(Stock *node, long after, StockRec *recs, int n);
 int buy_stock(Stock *root, int id, int num);
 void sell_stock(Stock *root, int id, int num);
+int parse_legs(char *buf, Leg *legs);
+void find_leg(Leg *leg);
+int batch_order(Leg *legs, int n);
+int apply_legs(Leg *legs, int n);
 void save_stocks(const char *filename, Stock *root);
+void write_stocks(Stock *root, const char *tmp, const char *filename);
+void create_db(const char *filename, const char *catalog);
+int copy_records(int from, StockRec *recs);
+void *bgsave_thread(void *vargp);
+void bgsave(void);
+void bgsave_db(void);
+Stock *load_persisted(const char *filename);
+void mark_dirty(Stock *stock);
+DirtyRec *collect_dirty(int *np);
+void write_dirty(DirtyRec *recs, int n);
+int dirty_slot_cmp(const void *a, const void *b);
+void flush_dirty(void);
+int count_stocks(Stock *node);
+void build_table(Stock **rootp);
+void fill_records(Stock *node, Stock *records, int *i);
+Stock *link_records(Stock *records, int lo, int hi);
+void fill_keys(int k, int *i);
+Stock *table_find(int id);
+void free_table(void);
+void build_hash(Stock *node);
+unsigned stock_hash_func(const struct hash_elem *e, void *aux);
+bool stock_less_func(const struct hash_elem *a, const struct hash_elem *b, void *aux);
+void fill_ids(Stock *node, int *ids, int *i);
+void bench_lookups(Stock *root, long lookups);
+void build_show_cache(Stock *root);
+void size_stocks(Stock *node, int *i);
+void render_stocks(Stock *node, version_t *v);
+char *show_slot(version_t *v, int i);
+void fill_show_slot(char *slot, int width, Stock *stock);
+void patch_show_cache(Stock **stocks, int n);
+void write_show_cache(stream_t *out);
+version_t *new_snapshot(int n);
+void fill_snapshot(Stock *node, version_t *snap, int *i);
+void publish_snapshot(Stock *root);
+void publish_stocks(Stock **stocks, int n);
+void print_snapshot(stream_t *out);
 
 void sigint_handler(int sig) {
-    P(&stock_sem);
+    log_flush();
+    print_queue_stats();
+    print_lock_stats();
+    if (wal_mode) {
+        long appends, syncs;
+        wal_stats(&appends, &syncs);
+        printf("wal: %ld appends, %ld syncs\n", appends, syncs);
+    }
+    if (persist_mode) {
+        P(&flush_sem);
+    }
+    lock_table();
+    if (bgsave_pid > 0) {
+        kill(bgsave_pid, SIGKILL);
+        waitpid(bgsave_pid, NULL, 0);
+    }
     save_stocks("stock.txt", root);
-    free_stock(root);
-    V(&stock_sem);
+    if (wal_mode) {
+        unlink("stock.log.old");
+    }
+    if (db_mode) {
+        db_close(&db);
+    } else if (index_mode == INDEX_FLAT) {
+        free_table();
+    } else {
+        free_stock(root);
+    }
     exit(0);
 }
 
 int main(int argc, char **argv) {
-    int listenfd, *connfdp;
+    int listenfd, connfd, opt;
+    long bench = 0;
+    int sbufsize = SBUFSIZE, rw_policy = RW_WRITER_PREF;
     socklen_t clientlen;
     struct sockaddr_storage clientaddr;
-    char client_hostname[MAXLINE], client_port[MAXLINE];
     pthread_t tid;
+    sigset_t mask, prev_mask;
 
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    while ((opt = getopt(argc, argv, "t:q:l:r:si:B:cf:WS:DPL:R:")) != -1) {
+        if (opt == 'f' && !strcmp(optarg, "fixed")) {
+            reply_mode = STREAM_FIXED;
+        } else if (opt == 'f' && !strcmp(optarg, "length")) {
+            reply_mode = STREAM_LENGTH;
+        } else if (opt == 'W') {
+            wal_mode = 1;
+        } else if (opt == 'D') {
+            db_mode = 1;
+        } else if (opt == 'P') {
+            persist_mode = 1;
+        } else if (opt == 'S' && atoi(optarg) >= 0) {
+            bgsave_period = atoi(optarg);
+        } else if (opt == 'L' && log_parse_level(optarg) >= 0) {
+            log_level = log_parse_level(optarg);
+        } else if (opt == 'R' && atol(optarg) > 0) {
+            log_sample = atol(optarg);
+        } else if (opt == 'c') {
+            cache_mode = 1;
+        } else if (opt == 'i' && !strcmp(optarg, "tree")) {
+            index_mode = INDEX_TREE;
+        } else if (opt == 'i' && !strcmp(optarg, "flat")) {
+            index_mode = INDEX_FLAT;
+        } else if (opt == 'i' && !strcmp(optarg, "hash")) {
+            index_mode = INDEX_HASH;
+        } else if (opt == 'B' && atol(optarg) > 0) {
+            bench = atol(optarg);
+        } else if (opt == 's') {
+            snapshot_mode = 1;
+        } else if (opt == 'l' && !strcmp(optarg, "global")) {
+            lock_mode = LOCK_GLOBAL;
+        } else if (opt == 'l' && !strcmp(optarg, "stock")) {
+            lock_mode = LOCK_STOCK;
+        } else if (opt == 'l' && !strcmp(optarg, "rw")) {
+            lock_mode = LOCK_RW;
+        } else if (opt == 'r' && !strcmp(optarg, "reader")) {
+            rw_policy = RW_READER_PREF;
+        } else if (opt == 'r' && !strcmp(optarg, "writer")) {
+            rw_policy = RW_WRITER_PREF;
+        } else if (opt == 'r' && !strcmp(optarg, "fair")) {
+            rw_policy = RW_FAIR;
+        } else if (opt == 't' && atoi(optarg) > 0) {
+            nworkers = atoi(optarg);
+        } else if (opt == 'q' && atoi(optarg) > 0) {
+            sbufsize = atoi(optarg);
+        } else {
+            optind = argc;
+            break;
+        }
+    }
+    if (optind != argc - 1 && !bench) {
+        fprintf(stderr, "usage: %s [-t threads] [-q queue depth] [-l global|stock|rw] [-r reader|writer|fair] [-s] [-i tree|flat|hash] [-B lookups] [-c] [-f fixed|length] [-W] [-S seconds] [-D] [-P] [-L debug|info|warn|error|off] [-R sample] <port>\n", argv[0]);
         exit(1);
     }
 
     Signal(SIGINT, sigint_handler);
+    Signal(SIGUSR1, sigusr1_handler);
 
     Sem_init(&stock_sem, 0, 1);
+    Sem_init(&bgsave_sem, 0, 0);
+    Sem_init(&dirty_sem, 0, 1);
+    Sem_init(&flush_sem, 0, 1);
+    Sem_init(&stats_sem, 0, 1);
+    clock_gettime(CLOCK_MONOTONIC, &stats_last);
+    rwlock_init(&stock_rw, rw_policy);
     P(&stock_sem);
-    root = load_stocks("stock.txt");
+    if (db_mode && (snapshot_mode || cache_mode || index_mode != INDEX_TREE || lock_mode == LOCK_STOCK)) {
+        app_error("-D serves from the mapped file and cannot be combined with -s, -c, -i or -l stock");
+    }
+    if (db_mode && persist_mode) {
+        app_error("-D and -P both keep stock.db; use one of them");
+    }
+    if (persist_mode && bgsave_period < 0) {
+        bgsave_period = 0;   /* Flushes run on the snapshot thread */
+    }
+    if (persist_mode) {
+        root = load_persisted("stock.db");
+    } else if (!db_mode) {
+        root = load_stocks("stock.txt");
+    } else {
+        if (!db_open(&db, "stock.db")) {
+            create_db("stock.db", "stock.txt");
+            db_open(&db, "stock.db");
+        }
+        printf("mapped %d stocks from stock.db\n", db.n);
+        if (wal_mode) {
+            replay_logs(&root);
+        }
+    }
+    if (wal_mode) {
+        wal_open("stock.log");
+    }
+    if (index_mode == INDEX_FLAT) {
+        build_table(&root);
+    } else if (index_mode == INDEX_HASH) {
+        hash_init(&stock_hash, stock_hash_func, stock_less_func, NULL);
+        build_hash(root);
+    }
+    if (bench) {
+        bench_lookups(root, bench);
+        exit(0);
+    }
+    Sem_init(&show_sem, 0, 1);
+    if (cache_mode) {
+        build_show_cache(root);
+    }
     V(&stock_sem);
+    Sem_init(&snapshot_sem, 0, 1);
+    if (snapshot_mode) {
+        publish_snapshot(root);
+    }
 
-    listenfd = Open_listenfd(argv[1]);
+    listenfd = Open_listenfd(argv[optind]);
+
+    /* Workers never take SIGINT or SIGUSR1, so a handler cannot interrupt a holder of stock_sem */
+    sbuf_init(&sbuf, sbufsize);
+    Sigemptyset(&mask);
+    Sigaddset(&mask, SIGINT);
+    Sigaddset(&mask, SIGUSR1);
+    Sigprocmask(SIG_BLOCK, &mask, &prev_mask);
+    log_init();
+    for (int i = 0; i < nworkers; i++) {
+        Pthread_create(&tid, NULL, worker_thread, NULL);
+    }
+    if (bgsave_period >= 0) {
+        Pthread_create(&tid, NULL, bgsave_thread, NULL);
+    }
+    Sigprocmask(SIG_SETMASK, &prev_mask, NULL);
 
     while (1) {
         clientlen = sizeof(struct sockaddr_storage);
-        connfdp = Malloc(sizeof(int));
-        *connfdp = Accept(listenfd, (SA *)&clientaddr, &clientlen);
-        Getnameinfo((SA *)&clientaddr, clientlen, client_hostname, MAXLINE, client_port, MAXLINE, 0);
-        printf("Connected to (%s, %s)\n", client_hostname, client_port);
-        Pthread_create(&tid, NULL, client_thread, connfdp);
+        connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
+        log_connected(&clientaddr);
+        STATS_ADD(accepts, 1);
+        __atomic_add_fetch(&open_clients, 1, __ATOMIC_RELAXED);
+        sbuf_insert(&sbuf, connfd);
     }
 }
 
-void *client_thread(void *vargp) {
-    int connfd = *((int *)vargp);
+void *worker_thread(void *vargp) {
+    batch_t *b = Malloc(sizeof(batch_t));
+    long wait;
+
     Pthread_detach(Pthread_self());
-    Free(vargp);
+    while (1) {
+        int connfd = sbuf_remove(&sbuf, &wait);
+        STATS_ADD(queued, 1);
+        STATS_ADD(queue_wait, wait);
+        STATS_MAX(queue_max_wait, wait);
+        __atomic_add_fetch(&active_clients, 1, __ATOMIC_ACQ_REL);
+        serve_client(connfd, b);
+        Close(connfd);
+        __atomic_sub_fetch(&open_clients, 1, __ATOMIC_RELAXED);
+        if (__atomic_sub_fetch(&active_clients, 1, __ATOMIC_ACQ_REL) == 0 && bgsave_period >= 0) {
+            V(&bgsave_sem);   /* The last client left */
+        }
+    }
+}
+
+/* The address goes to the log as numbers, with no DNS lookup on the accept path */
+void log_connected(struct sockaddr_storage *addr) {
+    struct sockaddr_in *sin = (struct sockaddr_in *)addr;
+    long ip;
 
+    if (addr->ss_family != AF_INET) {
+        LOG(LOG_INFO, "Connected to (IPv6, %ld)", (long)ntohs(((struct sockaddr_in6 *)addr)->sin6_port));
+        return;
+    }
+    ip = ntohl(sin->sin_addr.s_addr);
+    LOG(LOG_INFO, "Connected to (%ld.%ld.%ld.%ld, %ld)",
+        ip >> 24, (ip >> 16) & 255, (ip >> 8) & 255, ip & 255, (long)ntohs(sin->sin_port));
+}
+
+/*
+ * Replies queue up on b while more pipelined requests are already in rio,
+ * and go out in one writev before the next read that could block. With -W
+ * every writev first waits for the trades behind it to reach the log.
+ */
+void serve_client(int connfd, batch_t *b) {
     rio_t rio;
     Rio_readinitb(&rio, connfd);
     char buf[MAXBUF];
+    bin_req req;
+    stream_t *out;
     int n;
 
+    batch_init(b, connfd);
+    if (wal_mode) {
+        b->presend = wal_sync;
+    }
     while ((n = Rio_readlineb(&rio, buf, MAXBUF)) > 0) {
-        printf("server received %d bytes\n", (int)n);
-        if (!strncmp(buf, "exit", 4)) {
+        STATS_ADD(bytes_in, n);
+        LOG_SAMPLED(LOG_INFO, "server received %ld bytes", (long)n);
+        if (!strncmp(buf, "exit", 4) || !strcmp(buf, BIN_HELLO)) {
             break;
         }
-        parse_request(connfd, buf);
+        parse_request(batch_next(b, reply_mode), buf);
+        if (!request_ready(&rio, 0)) {
+            send_replies(b);
+        }
+    }
+    send_replies(b);
+    if (n <= 0 || strcmp(buf, BIN_HELLO)) {
+        return;
     }
 
-    Close(connfd);
-    return NULL;
+    /* Binary from here on: acknowledge, then fixed-size frames */
+    out = batch_next(b, STREAM_RAW);
+    stream_frame(out, BIN_OK, 0, 0, 0);
+    stream_end(out);
+    send_replies(b);
+    while (Rio_readnb(&rio, &req, sizeof(req)) == sizeof(req) && ntohl(req.op) != BIN_EXIT) {
+        STATS_ADD(bytes_in, sizeof(req));
+        out = batch_next(b, STREAM_RAW);
+        out->binary = 1;
+        parse_binary(out, &req);
+        if (!request_ready(&rio, 1)) {
+            send_replies(b);
+        }
+    }
+    send_replies(b);
+}
+
+void send_replies(batch_t *b) {
+    batch_send(b);
+    STATS_ADD(bytes_out, b->bytes);
+    b->bytes = 0;
+}
+
+/* Whether rio holds a whole request, so reading it cannot block */
+int request_ready(rio_t *rio, int binary) {
+    if (binary) {
+        return rio->rio_cnt >= (int)sizeof(bin_req);
+    }
+    return memchr(rio->rio_bufptr, '\n', rio->rio_cnt) != NULL;
+}
+
+void print_lock_stats(void) {
+    stats_t t;
+
+    if (lock_mode != LOCK_RW) {
+        return;
+    }
+    stats_sum(&t);
+    printf("rwlock: %ld reads, avg wait %.3f ms; %ld writes, avg wait %.3f ms\n",
+           t.rw_reads, t.rw_reads ? t.rw_read_wait / 1000.0 / t.rw_reads : 0.0,
+           t.rw_writes, t.rw_writes ? t.rw_write_wait / 1000.0 / t.rw_writes : 0.0);
 }
 
-void parse_request(int connfd, char *buf) {
+void print_queue_stats(void) {
+    stats_t t;
+
+    stats_sum(&t);
+    if (t.queued > 0) {
+        printf("queue: %ld connections, avg wait %.3f ms, max wait %.3f ms\n",
+               t.queued, t.queue_wait / 1000.0 / t.queued, t.queue_max_wait / 1000.0);
+    }
+}
+
+void parse_request(stream_t *out, char *buf) {
     char order[20];
-    int stock_id, num;
+    int stock_id, num, n;
+    Leg legs[MAXLEGS];
 
-    P(&stock_sem);
+    STATS_ADD(requests, 1);
     if (!strncmp(buf, "show", 4)) {
-        buf[0] = '\0';
-        print_stocks(root, buf);
-        if (strlen(buf) == 0) {
-            strcpy(buf, "No stocks available\n");
-        } else {
-            buf[strlen(buf) - 1] = '\n';
-        }
-    } else if (!strncmp(buf, "buy", 3)) {
+        show_stocks(out);
+        stream_end(out);
+        return;
+    }
+    if (!strncmp(buf, "stats", 5)) {
+        print_stats(out);
+        stream_end(out);
+        return;
+    }
+
+    if (!strncmp(buf, "buy", 3)) {
         if (sscanf(buf, "%s %d %d", order, &stock_id, &num) == 3) {
+            STATS_ADD(buys, 1);
             if (buy_stock(root, stock_id, num)) {
                 strcpy(buf, "[buy] success\n");
             } else {
+                STATS_ADD(failed_buys, 1);
                 strcpy(buf, "Not enough left stock\n");
             }
         } else {
@@ -106,65 +510,332 @@ void parse_request(int connfd, char *buf) {
         }
     } else if (!strncmp(buf, "sell", 4)) {
         if (sscanf(buf, "%s %d %d", order, &stock_id, &num) == 3) {
+            STATS_ADD(sells, 1);
             sell_stock(root, stock_id, num);
             strcpy(buf, "[sell] success\n");
         } else {
             strcpy(buf, "Wrong Command!\n");
         }
+    } else if (!strncmp(buf, "bgsave", 6) && bgsave_period >= 0) {
+        V(&bgsave_sem);
+        strcpy(buf, "[bgsave] started\n");
+    } else if (!strncmp(buf, "batch", 5)) {
+        if ((n = parse_legs(buf + 5, legs)) < 0) {
+            strcpy(buf, "Wrong Command!\n");
+        } else if (batch_order(legs, n)) {
+            strcpy(buf, "[batch] success\n");
+        } else {
+            strcpy(buf, "Not enough left stock\n");
+        }
     } else {
         strcpy(buf, "Wrong Command!\n");
     }
-    V(&stock_sem);
-    Rio_writen(connfd, buf, MAXLINE);
+    stream_puts(out, buf);
+    stream_end(out);
 }
 
-Stock *load_stocks(const char *filename) {
-    FILE *fp = Fopen(filename, "r");
-    Stock *root = NULL;
-    char line[100];
-    int id, quantity, price;
+/* Binary counterpart of parse_request: fixed fields, no parsing */
+void parse_binary(stream_t *out, bin_req *req) {
+    int op = ntohl(req->op), id = ntohl(req->id), num = ntohl(req->quantity);
+    int status = BIN_OK;
 
-    while (Fgets(line, sizeof(line), fp)) {
-        if (sscanf(line, "%d %d %d", &id, &quantity, &price) == 3) {
-            Stock *new_stock = make_stock(id, quantity, price);
-            root = insert_stock(root, new_stock);
+    STATS_ADD(requests, 1);
+    if (op == BIN_SHOW) {
+        show_stocks(out);
+        id = num = 0;
+    } else if (op == BIN_BUY) {
+        STATS_ADD(buys, 1);
+        if (!buy_stock(root, id, num)) {
+            STATS_ADD(failed_buys, 1);
+            status = BIN_SHORT;
         }
+    } else if (op == BIN_SELL) {
+        STATS_ADD(sells, 1);
+        sell_stock(root, id, num);
+    } else {
+        status = BIN_BAD;
+    }
+    stream_frame(out, status, id, num, 0);
+    stream_end(out);
+}
+
+/*
+ * Nothing is sent under a lock, so a slow reader stalls no one. Without a
+ * cache or snapshot, show copies SHOW_CHUNK records per table lock hold and
+ * sends them unlocked; trades between chunks show up in the later ones.
+ */
+void show_stocks(stream_t *out) {
+    StockRec recs[SHOW_CHUNK];
+    long after = LONG_MIN;
+    int n, from = 0;
+
+    STATS_ADD(shows, 1);
+    /* Sync our trades now so the presend of each chunk finds nothing to write */
+    if (wal_mode) {
+        wal_sync();
+    }
+    if (cache_mode && !out->binary) {
+        write_show_cache(out);
+    } else if (snapshot_mode) {
+        print_snapshot(out);
+    } else {
+        do {
+            lock_table();
+            n = db_mode ? copy_records(from, recs) : copy_stocks(root, after, recs, 0);
+            unlock_table();
+            for (int i = 0; i < n; i++) {
+                stream_stock(out, recs[i].id, recs[i].quantity, recs[i].price);
+            }
+            from += n;
+            after = n > 0 ? recs[n - 1].id : after;
+        } while (n == SHOW_CHUNK);
+    }
+    if (out->total == 0 && !out->binary) {
+        stream_puts(out, "No stocks available\n");
+    }
+}
+
+/* Counters summed over every thread; accepts/s covers the time since the previous report */
+void print_stats(stream_t *out) {
+    struct timespec now;
+    stats_t t;
+    double secs;
+    long accepts;
+
+    stats_sum(&t);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    P(&stats_sem);
+    secs = (now.tv_sec - stats_last.tv_sec) + (now.tv_nsec - stats_last.tv_nsec) / 1e9;
+    accepts = t.accepts - stats_last_accepts;
+    stats_last = now;
+    stats_last_accepts = t.accepts;
+    V(&stats_sem);
+
+    stream_printf(out, "requests %ld\n", t.requests);
+    stream_printf(out, "show %ld\nbuy %ld\nfailed buy %ld\nsell %ld\n",
+                  t.shows, t.buys, t.failed_buys, t.sells);
+    stream_printf(out, "bytes in %ld\nbytes out %ld\n", t.bytes_in, t.bytes_out);
+    stream_printf(out, "connections %d\n", __atomic_load_n(&open_clients, __ATOMIC_RELAXED));
+    stream_printf(out, "busy workers %d/%d\n", __atomic_load_n(&active_clients, __ATOMIC_RELAXED), nworkers);
+    stream_printf(out, "accepts %ld\naccepts/s %.1f\n", t.accepts, secs > 0 ? accepts / secs : 0.0);
+    stream_printf(out, "queued %ld\nqueue avg wait ms %.3f\nqueue max wait ms %.3f\n", t.queued,
+                  t.queued ? t.queue_wait / 1000.0 / t.queued : 0.0, t.queue_max_wait / 1000.0);
+    if (lock_mode == LOCK_RW) {
+        stream_printf(out, "rw reads %ld\nrw read avg wait ms %.3f\n", t.rw_reads,
+                      t.rw_reads ? t.rw_read_wait / 1000.0 / t.rw_reads : 0.0);
+        stream_printf(out, "rw writes %ld\nrw write avg wait ms %.3f\n", t.rw_writes,
+                      t.rw_writes ? t.rw_write_wait / 1000.0 / t.rw_writes : 0.0);
+    }
+}
+
+/* Dump the stats to stdout without stopping the server */
+void sigusr1_handler(int sig) {
+    stream_t out;
+
+    stream_init(&out, STDOUT_FILENO, STREAM_RAW);
+    print_stats(&out);
+    stream_end(&out);
+}
+
+/* Lock the whole table for reading, for show and save */
+void lock_table(void) {
+    if (lock_mode == LOCK_GLOBAL) {
+        P(&stock_sem);
+    } else if (lock_mode == LOCK_RW) {
+        read_lock(&stock_rw);
+    } else {
+        lock_stocks(root);
+    }
+}
+
+void unlock_table(void) {
+    if (lock_mode == LOCK_GLOBAL) {
+        V(&stock_sem);
+    } else if (lock_mode == LOCK_RW) {
+        read_unlock(&stock_rw);
+    } else {
+        unlock_stocks(root);
+    }
+}
+
+/* Per-stock locks are always taken in id order, so a show never deadlocks with a trade */
+void lock_stocks(Stock *node) {
+    if (!node) return;
+    lock_stocks(node->left);
+    P(&node->mutex);
+    lock_stocks(node->right);
+}
+
+void unlock_stocks(Stock *node) {
+    if (!node) return;
+    unlock_stocks(node->left);
+    V(&node->mutex);
+    unlock_stocks(node->right);
+}
+
+/* Find and lock a single stock; the tree shape is fixed after load_stocks() */
+Stock *lock_stock(Stock *root, int id) {
+    Stock *stock;
+    if (lock_mode == LOCK_GLOBAL) {
+        P(&stock_sem);
+        return find_stock(root, id);
+    }
+    if (lock_mode == LOCK_RW) {
+        write_lock(&stock_rw);
+        return find_stock(root, id);
+    }
+    stock = find_stock(root, id);
+    if (stock) {
+        P(&stock->mutex);
+    }
+    return stock;
+}
+
+void unlock_stock(Stock *stock) {
+    if (lock_mode == LOCK_GLOBAL) {
+        V(&stock_sem);
+    } else if (lock_mode == LOCK_RW) {
+        write_unlock(&stock_rw);
+    } else if (stock) {
+        V(&stock->mutex);
+    }
+}
+
+int stock_id_cmp(const void *a, const void *b) {
+    int x = (*(Stock **)a)->id, y = (*(Stock **)b)->id;
+    return (x > y) - (x < y);
+}
+
+/* Lock every stock a batch touches, in id order like lock_stocks(); returns how many */
+int lock_legs(Leg *legs, int n, Stock **locked) {
+    int nlocked = 0;
+
+    for (int i = 0; i < n; i++) {
+        find_leg(&legs[i]);
+        if (legs[i].stock) {
+            locked[nlocked++] = legs[i].stock;
+        }
+    }
+    if (lock_mode == LOCK_GLOBAL) {
+        P(&stock_sem);
+    } else if (lock_mode == LOCK_RW) {
+        write_lock(&stock_rw);
+    } else {
+        qsort(locked, nlocked, sizeof(Stock *), stock_id_cmp);
+        for (int i = 0; i < nlocked; i++) {
+            if (i == 0 || locked[i] != locked[i - 1]) {
+                P(&locked[i]->mutex);
+            }
+        }
+    }
+    return nlocked;
+}
+
+void unlock_legs(Stock **locked, int nlocked) {
+    if (lock_mode == LOCK_GLOBAL) {
+        V(&stock_sem);
+    } else if (lock_mode == LOCK_RW) {
+        write_unlock(&stock_rw);
+    } else {
+        for (int i = 0; i < nlocked; i++) {
+            if (i == 0 || locked[i] != locked[i - 1]) {
+                V(&locked[i]->mutex);
+            }
+        }
+    }
+}
+
+/* Parse the catalog in parallel, then build a balanced tree over the sorted records */
+Stock *load_stocks(const char *filename) {
+    struct timespec start, end;
+    StockRec *recs;
+    Stock *root;
+    long lines;
+    double secs;
+    int n;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    n = load_catalog(filename, &recs, &lines);
+    root = build_tree(recs, 0, n - 1);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    Free(recs);
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("loaded %d stocks from %s: %ld lines in %.3f s, %.0f lines/s\n",
+           n, filename, lines, secs, secs > 0 ? lines / secs : 0.0);
+    if (wal_mode) {
+        replay_logs(&root);
     }
-    Fclose(fp);
     return root;
 }
 
+/* stock.log.old is left over when a crash interrupted a background snapshot */
+void replay_logs(Stock **rootp) {
+    long n = wal_replay("stock.log.old", replay_stock, rootp);
+    n += wal_replay("stock.log", replay_stock, rootp);
+    printf("replayed %ld trades from stock.log\n", n);
+}
+
+/* Trade log records carry absolute quantities */
+void replay_stock(int id, int quantity, void *aux) {
+    StockRec *rec;
+    Stock *stock;
+
+    if (db_mode) {
+        if ((rec = db_find(&db, id)) != NULL) {
+            rec->quantity = quantity;
+        }
+    } else if ((stock = tree_find(*(Stock **)aux, id)) != NULL) {
+        stock->quantity = quantity;
+        if (persist_mode) {
+            mark_dirty(stock);
+        }
+    }
+}
+
+
 Stock *make_stock(int id, int quantity, int price) {
     Stock *new_stock = Malloc(sizeof(Stock));
     new_stock->id = id;
     new_stock->quantity = quantity;
     new_stock->price = price;
+    new_stock->dirty = 0;
+    Sem_init(&new_stock->mutex, 0, 1);
     new_stock->left = new_stock->right = NULL;
     return new_stock;
 }
 
-Stock *insert_stock(Stock *root, Stock *new_stock) {
-    if (!root) return new_stock;
-    if (root->id < new_stock->id) {
-        root->right = insert_stock(root->right, new_stock);
-    } else if (root->id > new_stock->id) {
-        root->left = insert_stock(root->left, new_stock);
-    } else {
-        root->price = new_stock->price;
-        root->quantity = new_stock->quantity;
-    }
-    return root;
+Stock *build_tree(StockRec *recs, int lo, int hi) {
+    int mid;
+    Stock *node;
+
+    if (lo > hi) return NULL;
+    mid = lo + (hi - lo) / 2;
+    node = make_stock(recs[mid].id, recs[mid].quantity, recs[mid].price);
+    node->rank = mid;
+    node->left = build_tree(recs, lo, mid - 1);
+    node->right = build_tree(recs, mid + 1, hi);
+    return node;
 }
 
 Stock *find_stock(Stock *node, int stock_id) {
-    if (!node) return NULL;
-    if (node->id == stock_id) {
-        return node;
+    if (index_mode == INDEX_FLAT) {
+        return table_find(stock_id);
     }
-    if (node->id > stock_id) {
-        return find_stock(node->left, stock_id);
+    if (index_mode == INDEX_HASH) {
+        Stock key;
+        struct hash_elem *e;
+        key.id = stock_id;
+        e = hash_find(&stock_hash, &key.elem);
+        return e ? hash_entry(e, Stock, elem) : NULL;
+    }
+    return tree_find(node, stock_id);
+}
+
+Stock *tree_find(Stock *node, int id) {
+    while (node && node->id != id) {
+        node = node->id > id ? node->left : node->right;
     }
-    return find_stock(node->right, stock_id);
+    return node;
 }
 
 void free_stock(Stock *node) {
@@ -174,35 +845,781 @@ void free_stock(Stock *node) {
     Free(node);
 }
 
-void print_stocks(Stock *root, char *buf) {
+void print_stocks(Stock *root, stream_t *out) {
     if (!root) return;
-    char line[100];
-    print_stocks(root->left, buf);
-    sprintf(line, "%d %d %d\n", root->id, root->quantity, root->price);
-    strcat(buf, line);
-    print_stocks(root->right, buf);
+    print_stocks(root->left, out);
+    stream_stock(out, root->id, root->quantity, root->price);
+    print_stocks(root->right, out);
+}
+
+/* Append stocks with ids above after to recs[n..] in id order until SHOW_CHUNK are there */
+int copy_stocks(Stock *node, long after, StockRec *recs, int n) {
+    if (!node || n == SHOW_CHUNK) return n;
+    if (node->id > after) {
+        n = copy_stocks(node->left, after, recs, n);
+        if (n == SHOW_CHUNK) return n;
+        recs[n].id = node->id;
+        recs[n].quantity = node->quantity;
+        recs[n].price = node->price;
+        n++;
+    }
+    return copy_stocks(node->right, after, recs, n);
 }
 
 int buy_stock(Stock *root, int id, int num) {
-    Stock *buy_stock = find_stock(root, id);
+    Stock *buy_stock;
+    if (db_mode) {
+        Leg leg = {id, -num};
+        return batch_order(&leg, 1);
+    }
+    buy_stock = lock_stock(root, id);
     if (!buy_stock || buy_stock->quantity < num) {
+        unlock_stock(buy_stock);
         return 0;
     }
     buy_stock->quantity -= num;
+    if (wal_mode) {
+        log_stock(buy_stock);
+    }
+    if (persist_mode) {
+        mark_dirty(buy_stock);
+    }
+    if (snapshot_mode) {
+        publish_stocks(&buy_stock, 1);
+    }
+    if (cache_mode) {
+        patch_show_cache(&buy_stock, 1);
+    }
+    unlock_stock(buy_stock);
     return 1;
 }
 
 void sell_stock(Stock *root, int id, int num) {
-    Stock *sell_stock = find_stock(root, id);
+    Stock *sell_stock;
+    if (db_mode) {
+        Leg leg = {id, num};
+        batch_order(&leg, 1);
+        return;
+    }
+    sell_stock = lock_stock(root, id);
     if (sell_stock) {
         sell_stock->quantity += num;
+        if (wal_mode) {
+            log_stock(sell_stock);
+        }
+        if (persist_mode) {
+            mark_dirty(sell_stock);
+        }
+        if (snapshot_mode) {
+            publish_stocks(&sell_stock, 1);
+        }
+        if (cache_mode) {
+            patch_show_cache(&sell_stock, 1);
+        }
+    }
+    unlock_stock(sell_stock);
+}
+
+/* Parse "buy|sell <id> <num>" legs; returns the number of legs, or -1 */
+int parse_legs(char *buf, Leg *legs) {
+    char order[20];
+    int n = 0, id, num, used;
+
+    while (sscanf(buf, "%19s %d %d%n", order, &id, &num, &used) == 3) {
+        if (n == MAXLEGS || num < 0) {
+            return -1;
+        }
+        if (!strcmp(order, "buy")) {
+            legs[n].delta = -num;
+        } else if (!strcmp(order, "sell")) {
+            legs[n].delta = num;
+        } else {
+            return -1;
+        }
+        legs[n++].id = id;
+        buf += used;
+    }
+    buf += strspn(buf, " \t\r\n");
+    return (n > 0 && *buf == '\0') ? n : -1;
+}
+
+/* Apply all legs or none, with one lock acquisition per stock touched */
+int batch_order(Leg *legs, int n) {
+    Stock *locked[MAXLEGS];
+    int nlocked, ok;
+
+    nlocked = lock_legs(legs, n, locked);
+    ok = apply_legs(legs, n);
+    unlock_legs(locked, nlocked);
+    return ok;
+}
+
+/* Point the leg at the quantity it changes, in the tree or in the mapped file */
+void find_leg(Leg *leg) {
+    StockRec *rec;
+
+    if (db_mode) {
+        rec = db_find(&db, leg->id);
+        leg->stock = NULL;
+        leg->quantity = rec ? &rec->quantity : NULL;
+    } else {
+        leg->stock = find_stock(root, leg->id);
+        leg->quantity = leg->stock ? &leg->stock->quantity : NULL;
+    }
+}
+
+/* Legs run in order; a buy of a missing or short stock rolls back the earlier ones */
+int apply_legs(Leg *legs, int n) {
+    Stock *touched[MAXLEGS];
+    int i, ntouched = 0;
+
+    for (i = 0; i < n; i++) {
+        if (legs[i].quantity == NULL) {
+            if (legs[i].delta < 0) {
+                break;
+            }
+        } else if (*legs[i].quantity + legs[i].delta < 0) {
+            break;
+        } else {
+            *legs[i].quantity += legs[i].delta;
+        }
+    }
+    if (i < n) {
+        while (--i >= 0) {
+            if (legs[i].quantity) {
+                *legs[i].quantity -= legs[i].delta;
+            }
+        }
+        return 0;
+    }
+
+    if (wal_mode) {
+        char rec[MAXLEGS * 24];
+        int len = 0;
+        for (i = 0; i < n; i++) {
+            if (legs[i].quantity) {
+                len += sprintf(rec + len, "%d %d\n", legs[i].id, *legs[i].quantity);
+            }
+        }
+        if (len > 0) {
+            wal_append(rec, len);
+        }
+    }
+    for (i = 0; i < n; i++) {
+        if (legs[i].stock) {
+            touched[ntouched++] = legs[i].stock;
+        }
+        if (legs[i].stock && persist_mode) {
+            mark_dirty(legs[i].stock);
+        }
+    }
+    /* Readers see the whole basket or none of it */
+    if (ntouched > 0 && snapshot_mode) {
+        publish_stocks(touched, ntouched);
     }
+    if (ntouched > 0 && cache_mode) {
+        patch_show_cache(touched, ntouched);
+    }
+    return 1;
 }
 
+/* With the trade log on, the file is replaced atomically and then the log is cut */
 void save_stocks(const char *filename, Stock *root) {
-    FILE *fp = Fopen(filename, "w");
-    char buf[MAXBUF] = {0};
-    print_stocks(root, buf);
-    Fputs(buf, fp);
+    char tmp[MAXLINE];
+    FILE *fp;
+    stream_t out;
+
+    if (db_mode) {
+        db_sync(&db);
+        if (wal_mode) {
+            wal_truncate();
+        }
+        return;
+    }
+    if (persist_mode) {
+        DirtyRec *recs;
+        int n;
+        recs = collect_dirty(&n);
+        write_dirty(recs, n);
+        if (wal_mode) {
+            wal_truncate();
+        }
+        return;
+    }
+
+    if (wal_mode) {
+        sprintf(tmp, "%s.tmp", filename);
+        write_stocks(root, tmp, filename);
+        wal_truncate();
+        return;
+    }
+    fp = Fopen(filename, "w");
+    stream_init(&out, fileno(fp), STREAM_RAW);
+    print_stocks(root, &out);
+    stream_end(&out);
     Fclose(fp);
-}
\ No newline at end of file
+}
+
+/* Write the table to tmp, flush it to disk and rename it over filename */
+void write_stocks(Stock *root, const char *tmp, const char *filename) {
+    int fd = Open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    stream_t out;
+
+    stream_init(&out, fd, STREAM_RAW);
+    print_stocks(root, &out);
+    stream_end(&out);
+    if (fsync(fd) < 0) {
+        unix_error("fsync error");
+    }
+    Close(fd);
+    if (rename(tmp, filename) < 0) {
+        unix_error("rename error");
+    }
+}
+
+/* Convert the text catalog the first time the server runs with -D */
+void create_db(const char *filename, const char *catalog) {
+    StockRec *recs;
+    long lines;
+    int n = load_catalog(catalog, &recs, &lines);
+
+    db_create(filename, recs, n);
+    Free(recs);
+}
+
+/* Copy up to SHOW_CHUNK mapped records starting at slot from; returns how many */
+int copy_records(int from, StockRec *recs) {
+    int n = 0;
+
+    while (n < SHOW_CHUNK && from + n < db.n) {
+        recs[n] = db.recs[from + n];
+        n++;
+    }
+    return n;
+}
+
+/* Take a background snapshot every bgsave_period seconds or when one is requested */
+void *bgsave_thread(void *vargp) {
+    struct timespec deadline;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        if (bgsave_period > 0) {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += bgsave_period;
+            while (sem_timedwait(&bgsave_sem, &deadline) < 0 && errno == EINTR)
+                ;
+        } else {
+            P(&bgsave_sem);
+        }
+        while (sem_trywait(&bgsave_sem) == 0)
+            ;   /* Requests queued meanwhile are covered by this snapshot */
+        bgsave();
+    }
+    return NULL;
+}
+
+/*
+ * Fork under the stock lock so the child sees a consistent copy-on-write
+ * view of the tree, and let it write stock.txt while the parent serves.
+ * Each page the parent then writes is copied by the kernel and shows up
+ * as a minor fault, so the parent's minor faults over the save estimate
+ * the copied pages. The count also takes in faults on fresh heap and
+ * stack pages, so it is an upper bound rather than an exact copy count.
+ */
+void bgsave(void) {
+    struct timespec start, forked, done;
+    struct rusage before, after;
+    int status = -1;
+    pid_t pid;
+
+    if (db_mode) {
+        bgsave_db();
+        return;
+    }
+    if (persist_mode) {
+        flush_dirty();
+        return;
+    }
+    getrusage(RUSAGE_SELF, &before);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    lock_table();
+    if (wal_mode) {
+        wal_rotate("stock.log.old");
+    }
+    if ((pid = Fork()) == 0) {
+        write_stocks(root, "stock.txt.bg", "stock.txt");
+        _exit(0);
+    }
+    bgsave_pid = pid;
+    unlock_table();
+    clock_gettime(CLOCK_MONOTONIC, &forked);
+
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+        ;
+    clock_gettime(CLOCK_MONOTONIC, &done);
+    getrusage(RUSAGE_SELF, &after);
+
+    lock_table();
+    bgsave_pid = 0;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "bgsave: child failed, saving in the foreground\n");
+        save_stocks("stock.txt", root);
+    }
+    if (wal_mode) {
+        unlink("stock.log.old");
+    }
+    unlock_table();
+    printf("bgsave: fork %ld us, total %ld us, %ld parent minor faults (est. pages copied)\n",
+           (forked.tv_sec - start.tv_sec) * 1000000 + (forked.tv_nsec - start.tv_nsec) / 1000,
+           (done.tv_sec - start.tv_sec) * 1000000 + (done.tv_nsec - start.tv_nsec) / 1000,
+           after.ru_minflt - before.ru_minflt);
+}
+
+/*
+ * The mapped file is already the snapshot; only its dirty pages need to
+ * reach disk. Trades that land after the log rotation may or may not be
+ * in the pages msync writes, but they are in the new log either way.
+ */
+void bgsave_db(void) {
+    struct timespec start, done;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (wal_mode) {
+        lock_table();
+        wal_rotate("stock.log.old");
+        unlock_table();
+    }
+    db_sync(&db);
+    if (wal_mode) {
+        unlink("stock.log.old");
+    }
+    clock_gettime(CLOCK_MONOTONIC, &done);
+    printf("bgsave: msync %ld us\n",
+           (done.tv_sec - start.tv_sec) * 1000000 + (done.tv_nsec - start.tv_nsec) / 1000);
+}
+
+/* Rebuild the tree from stock.db, creating it from stock.txt the first time */
+Stock *load_persisted(const char *filename) {
+    StockDB file;
+    Stock *root;
+
+    if (!db_open(&file, filename)) {
+        create_db(filename, "stock.txt");
+        db_open(&file, filename);
+    }
+    root = build_tree(file.recs, 0, file.n - 1);
+    printf("loaded %d stocks from %s\n", file.n, filename);
+    db_close(&file);
+    persist_fd = Open(filename, O_WRONLY, 0);
+    if (wal_mode) {
+        replay_logs(&root);
+    }
+    return root;
+}
+
+/* Queue stock for the next flush; the caller holds the stock's lock */
+void mark_dirty(Stock *stock) {
+    if (stock->dirty) return;
+    stock->dirty = 1;
+    P(&dirty_sem);
+    if (ndirty == dirty_cap) {
+        dirty_cap = dirty_cap ? 2 * dirty_cap : 1024;
+        dirty_ids = Realloc(dirty_ids, dirty_cap * sizeof(int));
+    }
+    dirty_ids[ndirty++] = stock->id;
+    V(&dirty_sem);
+}
+
+/* Copy out the dirty records and clear the set; the caller holds the table lock */
+DirtyRec *collect_dirty(int *np) {
+    DirtyRec *recs = Malloc((ndirty + 1) * sizeof(DirtyRec));
+    Stock *stock;
+
+    for (int i = 0; i < ndirty; i++) {
+        stock = find_stock(root, dirty_ids[i]);
+        stock->dirty = 0;
+        recs[i].slot = stock->rank;
+        recs[i].rec.id = stock->id;
+        recs[i].rec.quantity = stock->quantity;
+        recs[i].rec.price = stock->price;
+    }
+    *np = ndirty;
+    ndirty = 0;
+    return recs;
+}
+
+/* Overwrite each record in place, one pwrite per run of adjacent slots */
+void write_dirty(DirtyRec *recs, int n) {
+    StockRec *run = Malloc((n + 1) * sizeof(StockRec));
+    int i, j;
+
+    qsort(recs, n, sizeof(DirtyRec), dirty_slot_cmp);
+    for (i = 0; i < n; i = j) {
+        for (j = i; j < n && recs[j].slot == recs[i].slot + (j - i); j++) {
+            run[j - i] = recs[j].rec;
+        }
+        db_write(persist_fd, recs[i].slot, run, j - i);
+    }
+    if (fdatasync(persist_fd) < 0) {
+        unix_error("fdatasync error");
+    }
+    Free(run);
+    Free(recs);
+}
+
+int dirty_slot_cmp(const void *a, const void *b) {
+    int x = ((DirtyRec *)a)->slot, y = ((DirtyRec *)b)->slot;
+    return (x > y) - (x < y);
+}
+
+/* Only the copy of the dirty records is made under the lock; the writes are not */
+void flush_dirty(void) {
+    struct timespec start, done;
+    DirtyRec *recs;
+    int n;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    P(&flush_sem);
+    lock_table();
+    if (wal_mode) {
+        wal_rotate("stock.log.old");
+    }
+    recs = collect_dirty(&n);
+    unlock_table();
+    write_dirty(recs, n);
+    if (wal_mode) {
+        unlink("stock.log.old");
+    }
+    V(&flush_sem);
+    clock_gettime(CLOCK_MONOTONIC, &done);
+    printf("flush: %d records in %ld us\n", n,
+           (done.tv_sec - start.tv_sec) * 1000000 + (done.tv_nsec - start.tv_nsec) / 1000);
+}
+
+void log_stock(Stock *stock) {
+    char rec[32];
+    wal_append(rec, sprintf(rec, "%d %d\n", stock->id, stock->quantity));
+}
+
+int count_stocks(Stock *node) {
+    if (!node) return 0;
+    return count_stocks(node->left) + 1 + count_stocks(node->right);
+}
+
+/* A version of n records with private pages, not yet published */
+version_t *new_snapshot(int n) {
+    int npages = (n + SNAP_PAGE - 1) / SNAP_PAGE;
+    version_t *snap = version_new(n, npages);
+
+    for (int p = 0; p < npages; p++) {
+        version_page(snap, p, SNAP_PAGE * sizeof(StockRec));
+    }
+    return snap;
+}
+
+void fill_snapshot(Stock *node, version_t *snap, int *i) {
+    StockRec *rec;
+
+    if (!node) return;
+    fill_snapshot(node->left, snap, i);
+    rec = &SNAP_REC(snap, *i);
+    rec->id = node->id;
+    rec->quantity = node->quantity;
+    rec->price = node->price;
+    (*i)++;
+    fill_snapshot(node->right, snap, i);
+}
+
+void publish_snapshot(Stock *root) {
+    int i = 0;
+    version_t *snap = new_snapshot(count_stocks(root));
+
+    fill_snapshot(root, snap, &i);
+    version_publish(&snapshot, snap);
+}
+
+/*
+ * Publish one new version with every stock's quantity patched in. Only the
+ * pages holding those stocks are copied; the rest are shared with the old
+ * version. The caller holds their locks and takes snapshot_sem.
+ */
+void publish_stocks(Stock **stocks, int n) {
+    version_t *snap;
+    StockRec *recs;
+    int lo, hi, mid;
+
+    P(&snapshot_sem);
+    snap = version_copy(snapshot);
+    for (int k = 0; k < n; k++) {
+        for (lo = 0, hi = snap->n - 1; lo <= hi; ) {
+            mid = (lo + hi) / 2;
+            if (SNAP_REC(snap, mid).id == stocks[k]->id) {
+                recs = version_write(snap, mid / SNAP_PAGE);
+                recs[mid % SNAP_PAGE].quantity = stocks[k]->quantity;
+                break;
+            }
+            if (SNAP_REC(snap, mid).id < stocks[k]->id) {
+                lo = mid + 1;
+            } else {
+                hi = mid - 1;
+            }
+        }
+    }
+    version_publish(&snapshot, snap);
+    V(&snapshot_sem);
+}
+
+/* A slow reader holds only its own version, never the epoch */
+void print_snapshot(stream_t *out) {
+    version_t *snap = version_get(&snapshot);
+    StockRec *rec;
+
+    for (int i = 0; i < snap->n; i++) {
+        rec = &SNAP_REC(snap, i);
+        stream_stock(out, rec->id, rec->quantity, rec->price);
+    }
+    version_put(snap);
+}
+
+/* Batch-build the flat index and move every stock into one contiguous array */
+void build_table(Stock **rootp) {
+    long long span;
+    int i = 0;
+
+    table.n = count_stocks(*rootp);
+    table.records = Malloc((table.n + 1) * sizeof(Stock));
+    table.keys = Malloc((table.n + 1) * sizeof(int));
+    table.slots = Malloc((table.n + 1) * sizeof(int));
+    fill_records(*rootp, table.records, &i);
+    free_stock(*rootp);
+    for (i = 0; i < table.n; i++) {
+        Sem_init(&table.records[i].mutex, 0, 1);
+    }
+    *rootp = link_records(table.records, 0, table.n - 1);
+
+    i = 0;
+    fill_keys(1, &i);
+
+    table.direct = NULL;
+    if (table.n > 0) {
+        /* Wide, since ids at both ends of int overflow the span */
+        span = (long long)table.records[table.n - 1].id - table.records[0].id + 1;
+        if (span <= 2LL * table.n) {
+            table.min_id = table.records[0].id;
+            table.span = span;
+            table.direct = Calloc(table.span, sizeof(Stock *));
+            for (i = 0; i < table.n; i++) {
+                table.direct[table.records[i].id - table.min_id] = &table.records[i];
+            }
+        }
+    }
+}
+
+void fill_records(Stock *node, Stock *records, int *i) {
+    if (!node) return;
+    fill_records(node->left, records, i);
+    records[(*i)++] = *node;
+    fill_records(node->right, records, i);
+}
+
+/* Relink records[lo..hi] as a perfectly balanced tree for the in-order traversals */
+Stock *link_records(Stock *records, int lo, int hi) {
+    int mid;
+    Stock *node;
+
+    if (lo > hi) return NULL;
+    mid = lo + (hi - lo) / 2;
+    node = &records[mid];
+    node->left = link_records(records, lo, mid - 1);
+    node->right = link_records(records, mid + 1, hi);
+    return node;
+}
+
+void fill_keys(int k, int *i) {
+    if (k > table.n) return;
+    fill_keys(2 * k, i);
+    table.keys[k] = table.records[*i].id;
+    table.slots[k] = (*i)++;
+    fill_keys(2 * k + 1, i);
+}
+
+Stock *table_find(int id) {
+    int k = 1;
+
+    if (table.direct) {
+        if (id < table.min_id || (long long)id - table.min_id >= table.span) {
+            return NULL;
+        }
+        return table.direct[id - table.min_id];
+    }
+    while (k <= table.n) {
+        __builtin_prefetch(&table.keys[16 * k]);
+        k = 2 * k + (table.keys[k] < id);
+    }
+    k >>= __builtin_ffs(~k);
+    if (k == 0 || table.keys[k] != id) {
+        return NULL;
+    }
+    return &table.records[table.slots[k]];
+}
+
+void free_table(void) {
+    Free(table.records);
+    Free(table.keys);
+    Free(table.slots);
+    Free(table.direct);
+}
+
+/* The hash index only serves id lookups; show and save still walk the tree in order */
+void build_hash(Stock *node) {
+    if (!node) return;
+    build_hash(node->left);
+    hash_insert(&stock_hash, &node->elem);
+    build_hash(node->right);
+}
+
+unsigned stock_hash_func(const struct hash_elem *e, void *aux) {
+    return hash_int(hash_entry(e, Stock, elem)->id);
+}
+
+bool stock_less_func(const struct hash_elem *a, const struct hash_elem *b, void *aux) {
+    return hash_entry(a, Stock, elem)->id < hash_entry(b, Stock, elem)->id;
+}
+
+void fill_ids(Stock *node, int *ids, int *i) {
+    if (!node) return;
+    fill_ids(node->left, ids, i);
+    ids[(*i)++] = node->id;
+    fill_ids(node->right, ids, i);
+}
+
+/* Time find_stock() on random existing ids with the selected index, then exit */
+void bench_lookups(Stock *root, long lookups) {
+    int n = db_mode ? db.n : count_stocks(root), i = 0;
+    int *ids = Malloc((n + 1) * sizeof(int));
+    struct timespec start, end;
+    long found = 0;
+    double secs;
+
+    if (db_mode) {
+        for (i = 0; i < n; i++) {
+            ids[i] = db.recs[i].id;
+        }
+    } else {
+        fill_ids(root, ids, &i);
+    }
+    if (n == 0) {
+        ids[n++] = 0;
+    }
+    srand(1);
+    for (i = 0; i < n; i++) {
+        int j = rand() % n, tmp = ids[i];
+        ids[i] = ids[j];
+        ids[j] = tmp;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long k = 0; k < lookups; k++) {
+        if (db_mode) {
+            found += db_find(&db, ids[k % n]) != NULL;
+        } else {
+            found += find_stock(root, ids[k % n]) != NULL;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%s index: %d stocks, %ld lookups (%ld found) in %.3f s, %.1f ns/lookup\n",
+           db_mode ? "db" : index_mode == INDEX_FLAT ? "flat" : index_mode == INDEX_HASH ? "hash" : "tree",
+           db_mode ? db.n : count_stocks(root), lookups, found, secs, secs * 1e9 / lookups);
+    Free(ids);
+}
+
+void build_show_cache(Stock *root) {
+    int i = 0, npages, last;
+    version_t *v;
+
+    show_cache.n = count_stocks(root);
+    show_cache.off = Malloc((show_cache.n + 1) * sizeof(int));
+    show_cache.off[0] = 0;
+    size_stocks(root, &i);
+    npages = (show_cache.n + SHOW_PAGE - 1) / SHOW_PAGE;
+    v = version_new(show_cache.n, npages);
+    for (int p = 0; p < npages; p++) {
+        last = (p + 1) * SHOW_PAGE < show_cache.n ? (p + 1) * SHOW_PAGE : show_cache.n;
+        version_page(v, p, show_cache.off[last] - show_cache.off[p * SHOW_PAGE]);
+    }
+    render_stocks(root, v);
+    version_publish(&show_cache.cur, v);
+}
+
+/* Rank the stocks in id order and lay out their slots */
+void size_stocks(Stock *node, int *i) {
+    char line[40];
+    int width;
+
+    if (!node) return;
+    size_stocks(node->left, i);
+    node->rank = *i;
+    width = sprintf(line, "%d  %d\n", node->id, node->price) + SHOW_QTY;
+    show_cache.off[*i + 1] = show_cache.off[*i] + width;
+    (*i)++;
+    size_stocks(node->right, i);
+}
+
+void render_stocks(Stock *node, version_t *v) {
+    int i;
+
+    if (!node) return;
+    render_stocks(node->left, v);
+    i = node->rank;
+    fill_show_slot(show_slot(v, i), show_cache.off[i + 1] - show_cache.off[i], node);
+    render_stocks(node->right, v);
+}
+
+/* Where record i's slot lies in v; its page must already be private for a write */
+char *show_slot(version_t *v, int i) {
+    return v->pages[i / SHOW_PAGE]->data + show_cache.off[i] - show_cache.off[i / SHOW_PAGE * SHOW_PAGE];
+}
+
+/* The record, then spaces up to the newline that ends its slot */
+void fill_show_slot(char *slot, int width, Stock *stock) {
+    char line[40];
+    int len = sprintf(line, "%d %d %d", stock->id, stock->quantity, stock->price);
+
+    memcpy(slot, line, len);
+    memset(slot + len, ' ', width - 1 - len);
+    slot[width - 1] = '\n';
+}
+
+/* Publish the trade's records re-rendered in their slots as one version; the caller holds their locks */
+void patch_show_cache(Stock **stocks, int n) {
+    char line[MAXLEGS][40];
+    int width[MAXLEGS], i;
+    version_t *v;
+
+    for (int k = 0; k < n; k++) {
+        i = stocks[k]->rank;
+        width[k] = show_cache.off[i + 1] - show_cache.off[i];
+        fill_show_slot(line[k], width[k], stocks[k]);
+    }
+    P(&show_sem);
+    v = version_copy(show_cache.cur);
+    for (int k = 0; k < n; k++) {
+        version_write(v, stocks[k]->rank / SHOW_PAGE);
+        memcpy(show_slot(v, stocks[k]->rank), line[k], width[k]);
+    }
+    version_publish(&show_cache.cur, v);
+    V(&show_sem);
+}
+
+/* The rendered pages go out as they are, with no lock held */
+void write_show_cache(stream_t *out) {
+    version_t *v = version_get(&show_cache.cur);
+
+    for (int p = 0; p < v->npages; p++) {
+        stream_write(out, v->pages[p]->data, v->pages[p]->size);
+    }
+    version_put(v);
+}
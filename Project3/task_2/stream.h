@@ -0,0 +1,75 @@
+/*
+ * stream.h - bounded output buffer for replies and stock file writes
+ */
+#ifndef __STREAM_H__
+#define __STREAM_H__
+
+#include "csapp.h"
+#include <sys/uio.h>
+
+/* How a stream frames its output */
+enum {
+    STREAM_RAW,       /* Plain bytes, e.g. stock.txt */
+    STREAM_FIXED,     /* Legacy reply: NUL padded MAXLINE frames */
+    STREAM_LENGTH     /* Reply chunks behind a 4-byte length header */
+};
+
+#define STREAM_HDR 4               /* Length header size */
+#define STREAM_MORE 0x80000000u    /* Header flag: another chunk follows */
+#define BATCH_MAX 32               /* Replies coalesced into one writev */
+
+typedef struct stream {
+    void (*flush)(struct stream *sp, const char *data, size_t len);
+    void *arg;           /* Owner data for a custom flush function */
+    int fd;              /* Descriptor written by the default flush */
+    int mode;            /* STREAM_RAW, STREAM_FIXED or STREAM_LENGTH */
+    int binary;          /* Stocks go out as bin_reply frames */
+    int last;            /* Set while the final chunk is flushed */
+    size_t len;          /* Unflushed payload bytes */
+    size_t total;        /* Payload bytes written since stream_init */
+    char buf[STREAM_HDR + MAXLINE];   /* Header room, then payload */
+} stream_t;
+
+/* Bytes a non-blocking socket would not take yet, in send order */
+typedef struct {
+    char *buf;
+    size_t off, len, cap;  /* Unsent bytes are buf[off, len) */
+    int failed;            /* A send failed; the peer is gone */
+} outq_t;
+
+/* Replies to pipelined requests, held until they can go out together */
+typedef struct {
+    int fd;
+    outq_t *q;                      /* If set, sends never block and queue the rest here */
+    void (*presend)(void);          /* If set, runs before any reply bytes leave */
+    size_t bytes;                   /* Reply bytes sent or queued since batch_init */
+    int used;                       /* Streams handed out since the last send */
+    int niov;
+    struct iovec iov[BATCH_MAX];
+    stream_t out[BATCH_MAX];
+} batch_t;
+
+void stream_fd_flush(stream_t *sp, const char *data, size_t len);
+void stream_init(stream_t *sp, int fd, int mode);
+void stream_emit(stream_t *sp, int last);
+void stream_write(stream_t *sp, const void *data, size_t len);
+void stream_puts(stream_t *sp, const char *str);
+void stream_printf(stream_t *sp, const char *fmt, ...);
+void stream_frame(stream_t *sp, int status, int id, int quantity, int price);
+void stream_stock(stream_t *sp, int id, int quantity, int price);
+void stream_end(stream_t *sp);
+
+void batch_init(batch_t *b, int fd);
+stream_t *batch_next(batch_t *b, int mode);
+void batch_flush(stream_t *sp, const char *data, size_t len);
+void batch_writev(batch_t *b);
+void batch_send(batch_t *b);
+
+void outq_init(outq_t *q);
+size_t outq_pending(outq_t *q);
+void outq_append(outq_t *q, const char *data, size_t len);
+void outq_writev(outq_t *q, int fd, struct iovec *iov, int n);
+int outq_drain(outq_t *q, int fd);
+void outq_free(outq_t *q);
+
+#endif /* __STREAM_H__ */
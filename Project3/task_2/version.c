@@ -0,0 +1,95 @@
+/*
+ * version.c - immutable paged versions shared with lock-free readers
+ *
+ * A writer copies the page pointers of the current version, copies only
+ * the pages it changes and publishes the result; every page it left
+ * alone is shared and counted. A reader takes a reference inside an EBR
+ * epoch and leaves the epoch before it reads, so a slow reader keeps
+ * the pages of its own version alive and nothing else. The published
+ * reference to a replaced version is dropped once no reader can still
+ * be picking it up. Callers serialize writers.
+ */
+#include "csapp.h"
+#include "ebr.h"
+#include "version.h"
+
+/* An unpublished version with npages pages still to be given */
+version_t *version_new(int n, int npages) {
+    version_t *v = Calloc(1, sizeof(version_t) + npages * sizeof(vpage_t *));
+
+    v->refs = 1;
+    v->n = n;
+    v->npages = npages;
+    return v;
+}
+
+/* Give v a fresh private page p of size bytes */
+void *version_page(version_t *v, int p, int size) {
+    vpage_t *page = Malloc(sizeof(vpage_t) + size);
+
+    page->refs = 1;
+    page->size = size;
+    v->pages[p] = page;
+    return page->data;
+}
+
+/* An unpublished version sharing every page of old */
+version_t *version_copy(version_t *old) {
+    size_t size = sizeof(version_t) + old->npages * sizeof(vpage_t *);
+    version_t *v = Malloc(size);
+
+    memcpy(v, old, size);
+    v->refs = 1;
+    for (int p = 0; p < v->npages; p++) {
+        __atomic_add_fetch(&v->pages[p]->refs, 1, __ATOMIC_RELAXED);
+    }
+    return v;
+}
+
+/* Page p of an unpublished version, copied first if another version holds it too */
+void *version_write(version_t *v, int p) {
+    vpage_t *page = v->pages[p];
+
+    if (__atomic_load_n(&page->refs, __ATOMIC_ACQUIRE) > 1) {
+        memcpy(version_page(v, p, page->size), page->data, page->size);
+        if (__atomic_sub_fetch(&page->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+            Free(page);
+        }
+    }
+    return v->pages[p]->data;
+}
+
+void version_publish(version_t **slot, version_t *v) {
+    version_t *old = *slot;
+
+    __atomic_store_n(slot, v, __ATOMIC_RELEASE);
+    if (old) {
+        ebr_retire(old, version_put);
+    }
+}
+
+/* Pin the current version; the epoch only has to cover the load and the increment */
+version_t *version_get(version_t **slot) {
+    version_t *v;
+
+    ebr_enter();
+    v = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    __atomic_add_fetch(&v->refs, 1, __ATOMIC_RELAXED);
+    ebr_exit();
+    return v;
+}
+
+/* Drop a reference; the last one frees the version and every page no other version holds */
+void version_put(void *ptr) {
+    version_t *v = ptr;
+
+    if (__atomic_sub_fetch(&v->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+        return;
+    }
+    for (int p = 0; p < v->npages; p++) {
+        if (__atomic_sub_fetch(&v->pages[p]->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+            Free(v->pages[p]);
+        }
+    }
+    Free(v);
+}
@@ -0,0 +1,153 @@
+/*
+ * wal.c - append-only trade log with group commit
+ *
+ * Each trade appends an "id quantity" line with the stock's new quantity.
+ * Records gather in memory until a thread calls wal_sync() before it
+ * replies. The first such thread becomes the leader and writes and
+ * fdatasyncs everything appended so far. Threads that queue behind it
+ * usually find their records already covered by that one sync. Records
+ * carry absolute quantities, so replaying a log over a stock file that
+ * already includes some of them gives the same result.
+ */
+#include "csapp.h"
+#include "wal.h"
+
+typedef struct {
+    int fd;
+    char filename[MAXLINE];
+    char *buf, *spare;          /* Filling / last written buffer */
+    size_t len, cap, spare_cap;
+    long appended;              /* Bytes appended since wal_open */
+    long durable;               /* Bytes written and synced */
+    long appends, syncs;
+    sem_t mutex;                /* Protects buf, len and appended */
+    sem_t leader;               /* Held by the thread writing a group */
+} wal_t;
+
+wal_t wal;
+__thread long wal_mine = 0;     /* End of this thread's last record */
+
+void wal_open(const char *filename) {
+    if ((wal.fd = open(filename, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0) {
+        unix_error("wal_open error");
+    }
+    strcpy(wal.filename, filename);
+    wal.buf = wal.spare = NULL;
+    wal.len = wal.cap = wal.spare_cap = 0;
+    wal.appended = wal.durable = 0;
+    wal.appends = wal.syncs = 0;
+    Sem_init(&wal.mutex, 0, 1);
+    Sem_init(&wal.leader, 0, 1);
+}
+
+/* Callers append a whole batch at once so it lands in a single group */
+void wal_append(const char *rec, size_t len) {
+    P(&wal.mutex);
+    if (wal.len + len > wal.cap) {
+        wal.cap = wal.cap ? 2 * wal.cap : 4096;
+        if (wal.cap < wal.len + len) {
+            wal.cap = wal.len + len;
+        }
+        wal.buf = Realloc(wal.buf, wal.cap);
+    }
+    memcpy(wal.buf + wal.len, rec, len);
+    wal.len += len;
+    wal.appended += len;
+    wal.appends++;
+    wal_mine = wal.appended;
+    V(&wal.mutex);
+}
+
+/* Return once every record this thread appended is on disk */
+void wal_sync(void) {
+    char *buf;
+    size_t len, cap, off;
+    long end;
+    ssize_t n;
+
+    if (wal_mine <= __atomic_load_n(&wal.durable, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    P(&wal.leader);
+    if (wal_mine > __atomic_load_n(&wal.durable, __ATOMIC_ACQUIRE)) {
+        P(&wal.mutex);
+        buf = wal.buf;
+        len = wal.len;
+        cap = wal.cap;
+        end = wal.appended;
+        wal.buf = wal.spare;
+        wal.cap = wal.spare_cap;
+        wal.len = 0;
+        wal.spare = buf;
+        wal.spare_cap = cap;
+        V(&wal.mutex);
+
+        for (off = 0; off < len; off += n) {
+            if ((n = write(wal.fd, buf + off, len - off)) < 0) {
+                if (errno == EINTR) {
+                    n = 0;
+                    continue;
+                }
+                unix_error("wal write error");
+            }
+        }
+        if (fdatasync(wal.fd) < 0) {
+            unix_error("wal fdatasync error");
+        }
+        wal.syncs++;
+        __atomic_store_n(&wal.durable, end, __ATOMIC_RELEASE);
+    }
+    V(&wal.leader);
+}
+
+/* Drop the log once the stock file holds every logged trade */
+void wal_truncate(void) {
+    if (ftruncate(wal.fd, 0) < 0) {
+        unix_error("wal_truncate error");
+    }
+}
+
+/*
+ * Move the log to old and continue in a fresh file. Taking the leader
+ * keeps the rename from splitting a group write; records still in memory
+ * go to the new file, which is harmless since replay is idempotent.
+ */
+void wal_rotate(const char *old) {
+    int fd;
+
+    P(&wal.leader);
+    if (rename(wal.filename, old) < 0) {
+        unix_error("wal_rotate error");
+    }
+    if ((fd = open(wal.filename, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0) {
+        unix_error("wal_rotate error");
+    }
+    Close(wal.fd);
+    wal.fd = fd;
+    V(&wal.leader);
+}
+
+/* Apply every complete record in filename; returns how many were applied */
+long wal_replay(const char *filename, void (*apply)(int id, int quantity, void *aux), void *aux) {
+    FILE *fp;
+    char line[64];
+    int id, quantity;
+    long n = 0;
+
+    if ((fp = fopen(filename, "r")) == NULL) {
+        return 0;
+    }
+    while (Fgets(line, sizeof(line), fp)) {
+        if (strchr(line, '\n') && sscanf(line, "%d %d", &id, &quantity) == 2) {
+            apply(id, quantity, aux);
+            n++;
+        }
+    }
+    Fclose(fp);
+    return n;
+}
+
+void wal_stats(long *appends, long *syncs) {
+    *appends = wal.appends;
+    *syncs = wal.syncs;
+}